@@ -27,8 +27,13 @@
 #include "php.h"
 #include "php_amf3.h"
 #include "zend_interfaces.h"
+#include "zend_smart_str.h"
 #include "amf3.h"
 
+#define INTBLOCK 64 /* Number of integers to decode with a single bounds check in dense arrays */
+#define PRESIZE 1024 /* Maximum number of elements to allocate in advance */
+#define REFEXPAND 64 /* Maximum JSON output by reference expansion per input byte unless 'max_bytes' is set */
+
 /* For PHP 7.0 and 7.1 */
 #ifndef HT_ALLOW_COW_VIOLATION
 #define HT_ALLOW_COW_VIOLATION(ht)
@@ -41,6 +46,12 @@ typedef struct {
 	int *flen;
 } Traits;
 
+typedef struct {
+	const DecodeOptions *lim;
+	int opts, lvl;
+	zend_long elems, bytes; /* Number of values and string bytes produced so far */
+} Context;
+
 static size_t decodeByte(const char *buf, size_t pos, size_t size, int *val) {
 	if (pos >= size) {
 		php_error(E_WARNING, "Insufficient data at position %zu", pos);
@@ -50,9 +61,30 @@ static size_t decodeByte(const char *buf, size_t pos, size_t size, int *val) {
 	return pos + 1;
 }
 
+static const unsigned char *unpackU29(const unsigned char *p, int *val) { /* No bounds check */
+	int x = p[0];
+	if (x < 0x80) {
+		*val = x;
+		return p + 1;
+	}
+	x = (x & 0x7f) << 7 | (p[1] & 0x7f);
+	if (p[1] < 0x80) {
+		*val = x;
+		return p + 2;
+	}
+	x = x << 7 | (p[2] & 0x7f);
+	if (p[2] < 0x80) {
+		*val = x;
+		return p + 3;
+	}
+	*val = x << 8 | p[3];
+	return p + 4;
+}
+
 static size_t decodeU29(const char *buf, size_t pos, size_t size, int *val) {
 	int len = 0, x = 0;
 	unsigned char c;
+	if (size - pos >= 4) return (const char *)unpackU29((const unsigned char *)buf + pos, val) - buf;
 	buf += pos;
 	do {
 		if (pos + len >= size) {
@@ -120,7 +152,108 @@ static size_t decodeDouble(const char *buf, size_t pos, size_t size, zval *val)
 	return pos + 8;
 }
 
-static size_t decodeString(const char *buf, size_t pos, size_t size, zval *val, const char **str, int *len, HashTable *ht, int raw) {
+static int checkBytes(Context *ctx, size_t len, size_t pos) {
+	ctx->bytes += len;
+	if (!ctx->lim->max_bytes || ctx->bytes <= ctx->lim->max_bytes) return 1;
+	php_error(E_WARNING, "Byte limit exceeded at position %zu", pos);
+	return 0;
+}
+
+static int checkValue(Context *ctx, size_t pos) {
+	const DecodeOptions *lim = ctx->lim;
+	if (lim->max_depth && ctx->lvl >= lim->max_depth) {
+		php_error(E_WARNING, "Depth limit exceeded at position %zu", pos);
+		return 0;
+	}
+	if (lim->max_elements && ++ctx->elems > lim->max_elements) {
+		php_error(E_WARNING, "Element limit exceeded at position %zu", pos);
+		return 0;
+	}
+	return 1;
+}
+
+static uint32_t getPresize(Context *ctx, size_t len, size_t rem) { /* Length claimed by a header can't be trusted */
+	zend_long max = ctx->lim->max_elements;
+	if (len > rem) len = rem; /* Every element takes at least 1 byte */
+	if (max) { /* Nor can it exceed the remaining element budget */
+		size_t left = ctx->elems < max ? (size_t)(max - ctx->elems) : 0;
+		if (len > left) len = left;
+	}
+	return len < PRESIZE ? len : PRESIZE;
+}
+
+static int checkRef(Context *ctx, size_t cnt, size_t pos) { /* Called before a new entry is added to a reference table */
+	zend_long max = ctx->lim->max_refs;
+	if (!max || cnt < (size_t)max) return 1;
+	php_error(E_WARNING, "Reference table limit exceeded at position %zu", pos);
+	return 0;
+}
+
+static int utf8Seq(const unsigned char *p, const unsigned char *e) { /* Length of a valid sequence, or minus length of an invalid one */
+	int c = *p, lo = 0x80, hi = 0xbf, n, i;
+	if (c >= 0xc2 && c <= 0xdf) n = 2;
+	else if (c >= 0xe0 && c <= 0xef) {
+		n = 3;
+		if (c == 0xe0) lo = 0xa0; /* Overlong */
+		else if (c == 0xed) hi = 0x9f; /* Surrogate */
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		n = 4;
+		if (c == 0xf0) lo = 0x90; /* Overlong */
+		else if (c == 0xf4) hi = 0x8f; /* Above U+10FFFF */
+	} else return -1;
+	for (i = 1; i < n; ++i, lo = 0x80, hi = 0xbf) {
+		if (p + i == e || p[i] < lo || p[i] > hi) return -i;
+	}
+	return n;
+}
+
+static size_t checkUtf8(const char *str, size_t len) { /* Length of the valid prefix */
+	const unsigned char *s = (const unsigned char *)str, *p = s, *e = s + len;
+	while (p < e) {
+		int n;
+		if (*p < 0x80) { /* Skip ASCII a word at a time */
+			uint64_t w;
+			for (++p; e - p >= 8; p += 8) {
+				memcpy(&w, p, 8);
+				if (w & 0x8080808080808080ULL) break;
+			}
+			while (p < e && *p < 0x80) ++p;
+			continue;
+		}
+		if ((n = utf8Seq(p, e)) < 0) break;
+		p += n;
+	}
+	return p - s;
+}
+
+static zend_string *fixUtf8(const char *str, size_t len, size_t pos) { /* Replace invalid sequences starting at 'pos' with U+FFFD */
+	const unsigned char *p = (const unsigned char *)str + pos, *e = (const unsigned char *)str + len;
+	smart_str ss = {0};
+	smart_str_appendl(&ss, str, pos);
+	while (p < e) {
+		smart_str_appendl(&ss, "\xef\xbf\xbd", 3);
+		p -= utf8Seq(p, e);
+		pos = checkUtf8((const char *)p, e - p);
+		smart_str_appendl(&ss, (const char *)p, pos);
+		p += pos;
+	}
+	smart_str_0(&ss);
+	return ss.s;
+}
+
+static int validUtf8(Context *ctx, const char *str, size_t len, size_t pos, zend_string **fix) {
+	size_t n;
+	*fix = 0;
+	if (!(ctx->opts & (AMF3_UTF8_VALIDATE | AMF3_UTF8_REPLACE)) || (n = checkUtf8(str, len)) == len) return 1;
+	if (!(ctx->opts & AMF3_UTF8_REPLACE)) {
+		php_error(E_WARNING, "Invalid UTF-8 sequence at position %zu", pos + n);
+		return 0;
+	}
+	*fix = fixUtf8(str, len, n);
+	return 1;
+}
+
+static size_t decodeString(const char *buf, size_t pos, size_t size, zval *val, const char **str, int *len, HashTable *ht, int raw, Context *ctx) {
 	int pfx, def;
 	size_t _pos = pos;
 	pos = decodeU29(buf, pos, size, &pfx);
@@ -128,20 +261,33 @@ static size_t decodeString(const char *buf, size_t pos, size_t size, zval *val,
 	def = pfx & 1;
 	pfx >>= 1;
 	if (def) {
+		zend_string *fix = 0;
 		if (pos + pfx > size) {
 			php_error(E_WARNING, "Insufficient data of length %d at position %zu", pfx, pos);
 			return 0;
 		}
+		if (!checkBytes(ctx, pfx, _pos)) return 0;
+		if ((raw || pfx) && !checkRef(ctx, zend_hash_num_elements(ht), _pos)) return 0;
+		if (!raw && !validUtf8(ctx, buf + pos, pfx, pos, &fix)) return 0;
 		buf += pos;
 		pos += pfx;
-		if (val) ZVAL_STRINGL(val, buf, pfx);
-		else {
+		if (val) {
+			if (fix) ZVAL_STR(val, fix);
+			else ZVAL_STRINGL(val, buf, pfx);
+#ifdef IS_STR_VALID_UTF8
+			if (!raw && (ctx->opts & (AMF3_UTF8_VALIDATE | AMF3_UTF8_REPLACE))) GC_ADD_FLAGS(Z_STR_P(val), IS_STR_VALID_UTF8);
+#endif
+		} else if (fix) {
+			*str = ZSTR_VAL(fix); /* Owned by the reference table */
+			*len = ZSTR_LEN(fix);
+		} else {
 			*str = buf;
 			*len = pfx;
 		}
 		if (raw || pfx) { /* Empty string is never sent by reference */
 			zval hv;
 			if (val) ZVAL_COPY(&hv, val);
+			else if (fix) ZVAL_STR(&hv, fix);
 			else ZVAL_STRINGL(&hv, buf, pfx);
 			zend_hash_next_index_insert(ht, &hv);
 		}
@@ -151,6 +297,7 @@ static size_t decodeString(const char *buf, size_t pos, size_t size, zval *val,
 			php_error(E_WARNING, "Invalid reference %d at position %zu", pfx, _pos);
 			return 0;
 		}
+		if (!checkBytes(ctx, Z_STRLEN_P(hv), _pos)) return 0;
 		if (val) ZVAL_COPY(val, hv);
 		else {
 			*str = Z_STRVAL_P(hv);
@@ -160,15 +307,17 @@ static size_t decodeString(const char *buf, size_t pos, size_t size, zval *val,
 	return pos;
 }
 
-static size_t decodeRef(const char *buf, size_t pos, size_t size, int *num, zval *val, HashTable *ht) {
+static size_t decodeRef(const char *buf, size_t pos, size_t size, int *num, zval *val, HashTable *ht, Context *ctx) {
 	int pfx, def;
 	size_t _pos = pos;
 	pos = decodeU29(buf, pos, size, &pfx);
 	if (!pos) return 0;
 	def = pfx & 1;
 	pfx >>= 1;
-	if (def) *num = pfx;
-	else {
+	if (def) {
+		if (!checkRef(ctx, zend_hash_num_elements(ht), _pos)) return 0;
+		*num = pfx;
+	} else {
 		zval *hv;
 		if (!(hv = zend_hash_index_find(ht, pfx))) {
 			php_error(E_WARNING, "Invalid reference %d at position %zu", pfx, _pos);
@@ -187,9 +336,9 @@ static void storeRef(zval *val, HashTable *ht) {
 	zend_hash_next_index_insert(ht, &hv);
 }
 
-static size_t decodeDate(const char *buf, size_t pos, size_t size, zval *val, HashTable *ht) {
+static size_t decodeDate(const char *buf, size_t pos, size_t size, zval *val, HashTable *ht, Context *ctx) {
 	int pfx;
-	pos = decodeRef(buf, pos, size, &pfx, val, ht);
+	pos = decodeRef(buf, pos, size, &pfx, val, ht, ctx);
 	if (!pos) return 0;
 	if (pfx != -1) {
 		pos = decodeDouble(buf, pos, size, val);
@@ -213,39 +362,72 @@ static zval *newHashKey(zval *val, const char *key, size_t len) {
 	return zend_symtable_str_update(HASH_OF(val), key, len, &hv);
 }
 
-static size_t decodeValue(const char *buf, size_t pos, size_t size, zval *val, int opts, HashTable *sht, HashTable *oht, HashTable *tht);
+static int countIntegers(const unsigned char *p, const unsigned char *e, int n) { /* Number of complete integers before 'e' */
+	int i, j;
+	for (i = 0; i < n && p < e && *p == AMF3_INTEGER; ++i) {
+		for (j = 1; j < 4 && p + j < e && (p[j] & 0x80); ++j);
+		if (p + j >= e) break;
+		p += j + 1;
+	}
+	return i;
+}
+
+static size_t decodeIntegers(const char *buf, size_t pos, size_t size, zval *val, int *len, Context *ctx) {
+	const unsigned char *p = (const unsigned char *)buf + pos, *s = p;
+	zend_long max = ctx->lim->max_elements;
+	int n, x;
+	if (ctx->lim->max_depth && ctx->lvl >= ctx->lim->max_depth) return pos;
+	while ((n = *len < INTBLOCK ? *len : INTBLOCK)) {
+		if (size - pos < (size_t)n * 5 && !(n = countIntegers(p, (const unsigned char *)buf + size, n))) break; /* Near the end, scan the actual lengths */
+		if (max && ctx->elems + n > max) break; /* Let decodeValue() report the exact position */
+		for (; n; --n, --*len, ++ctx->elems) {
+			if (*p != AMF3_INTEGER) return pos + (p - s);
+			p = unpackU29(p + 1, &x);
+			if (x & 0x10000000) x -= 0x20000000;
+			ZVAL_LONG(newHashIdx(val), x);
+		}
+		pos += p - s;
+		s = p;
+	}
+	return pos;
+}
+
+static size_t decodeValue(const char *buf, size_t pos, size_t size, zval *val, Context *ctx, HashTable *sht, HashTable *oht, HashTable *tht);
 
-static size_t decodeArray(const char *buf, size_t pos, size_t size, zval *val, int opts, HashTable *sht, HashTable *oht, HashTable *tht) {
+static size_t decodeArray(const char *buf, size_t pos, size_t size, zval *val, Context *ctx, HashTable *sht, HashTable *oht, HashTable *tht) {
 	int len;
-	pos = decodeRef(buf, pos, size, &len, val, oht);
+	pos = decodeRef(buf, pos, size, &len, val, oht, ctx);
 	if (!pos) return 0;
 	if (len != -1) {
 		const char *key;
 		int klen;
-		array_init(val);
+		array_init_size(val, getPresize(ctx, len, size - pos));
 		storeRef(val, oht);
 		for (;;) { /* Associative portion */
-			pos = decodeString(buf, pos, size, 0, &key, &klen, sht, 0);
+			pos = decodeString(buf, pos, size, 0, &key, &klen, sht, 0, ctx);
 			if (!pos) return 0;
 			if (!klen) break;
-			pos = decodeValue(buf, pos, size, newHashKey(val, key, klen), opts, sht, oht, tht);
+			pos = decodeValue(buf, pos, size, newHashKey(val, key, klen), ctx, sht, oht, tht);
 			if (!pos) return 0;
 		}
-		while (len--) { /* Dense portion */
-			pos = decodeValue(buf, pos, size, newHashIdx(val), opts, sht, oht, tht);
+		while (len) { /* Dense portion */
+			pos = decodeIntegers(buf, pos, size, val, &len, ctx);
+			if (!len) break;
+			pos = decodeValue(buf, pos, size, newHashIdx(val), ctx, sht, oht, tht);
 			if (!pos) return 0;
+			--len;
 		}
 	}
 	return pos;
 }
 
-static size_t decodeObject(const char *buf, size_t pos, size_t size, zval *val, int opts, HashTable *sht, HashTable *oht, HashTable *tht) {
+static size_t decodeObject(const char *buf, size_t pos, size_t size, zval *val, Context *ctx, HashTable *sht, HashTable *oht, HashTable *tht) {
 	int pfx;
 	size_t _pos = pos;
-	pos = decodeRef(buf, pos, size, &pfx, val, oht);
+	pos = decodeRef(buf, pos, size, &pfx, val, oht, ctx);
 	if (!pos) return 0;
 	if (pfx != -1) {
-		int map = opts & AMF3_CLASS_MAP;
+		int map = ctx->opts & AMF3_CLASS_MAP;
 		zend_class_entry *ce = 0;
 		Traits *tr;
 		const char *key;
@@ -258,7 +440,8 @@ static size_t decodeObject(const char *buf, size_t pos, size_t size, zval *val,
 			int clen;
 			const char **fld = 0;
 			int *flen = 0;
-			pos = decodeString(buf, pos, size, 0, &cls, &clen, sht, 0); /* Class name */
+			if (!checkRef(ctx, zend_hash_num_elements(tht), _pos)) return 0;
+			pos = decodeString(buf, pos, size, 0, &cls, &clen, sht, 0, ctx); /* Class name */
 			if (!pos) return 0;
 			if (n > 0) {
 				if (pos + n > size) {
@@ -269,7 +452,7 @@ static size_t decodeObject(const char *buf, size_t pos, size_t size, zval *val,
 				flen = emalloc(n * sizeof *flen);
 				for (i = 0; i < n; ++i) { /* Static member names */
 					size_t __pos = pos;
-					pos = decodeString(buf, pos, size, 0, &key, &klen, sht, 0);
+					pos = decodeString(buf, pos, size, 0, &key, &klen, sht, 0, ctx);
 					if (!pos) {
 						n = -1;
 						break;
@@ -304,7 +487,7 @@ static size_t decodeObject(const char *buf, size_t pos, size_t size, zval *val,
 			if (!tr->cls) object_init(val);
 			else {
 				int mode = ZEND_FETCH_CLASS_DEFAULT | ZEND_FETCH_CLASS_SILENT;
-				if (!(opts & AMF3_CLASS_AUTOLOAD)) mode |= ZEND_FETCH_CLASS_NO_AUTOLOAD;
+				if (!(ctx->opts & AMF3_CLASS_AUTOLOAD)) mode |= ZEND_FETCH_CLASS_NO_AUTOLOAD;
 				ce = zend_fetch_class(tr->cls, mode);
 				if (!ce) {
 					php_error(E_WARNING, "Unknown class '%s' at position %zu", ZSTR_VAL(tr->cls), _pos);
@@ -315,25 +498,25 @@ static size_t decodeObject(const char *buf, size_t pos, size_t size, zval *val,
 		}
 		storeRef(val, oht);
 		if (tr->fmt & 1) { /* Externalizable */
-			pos = decodeValue(buf, pos, size, newHashKey(val, "__data", sizeof "__data" - 1), opts, sht, oht, tht);
+			pos = decodeValue(buf, pos, size, newHashKey(val, "__data", sizeof "__data" - 1), ctx, sht, oht, tht);
 			if (!pos) return 0;
 		} else {
 			int i;
 			for (i = 0; i < tr->cnt; ++i) {
-				pos = decodeValue(buf, pos, size, newHashKey(val, tr->fld[i], tr->flen[i]), opts, sht, oht, tht);
+				pos = decodeValue(buf, pos, size, newHashKey(val, tr->fld[i], tr->flen[i]), ctx, sht, oht, tht);
 				if (!pos) return 0;
 			}
 			if (tr->fmt & 2) { /* Dynamic */
 				for (;;) {
 					size_t __pos = pos;
-					pos = decodeString(buf, pos, size, 0, &key, &klen, sht, 0);
+					pos = decodeString(buf, pos, size, 0, &key, &klen, sht, 0, ctx);
 					if (!pos) return 0;
 					if (!klen) break;
 					if (map && !key[0]) {
 						php_error(E_WARNING, "Invalid class member name at position %zu", __pos);
 						return 0;
 					}
-					pos = decodeValue(buf, pos, size, newHashKey(val, key, klen), opts, sht, oht, tht);
+					pos = decodeValue(buf, pos, size, newHashKey(val, key, klen), ctx, sht, oht, tht);
 					if (!pos) return 0;
 				}
 			}
@@ -341,7 +524,7 @@ static size_t decodeObject(const char *buf, size_t pos, size_t size, zval *val,
 		if (!map && tr->cls) {
 			HT_ALLOW_COW_VIOLATION(HASH_OF(val)); /* PHP DEBUG: suppress reference counter check */
 			add_assoc_stringl(val, "__class", ZSTR_VAL(tr->cls), ZSTR_LEN(tr->cls));
-		} else if (ce && (opts & AMF3_CLASS_CONSTRUCT)) { /* Call the constructor */
+		} else if (ce && (ctx->opts & AMF3_CLASS_CONSTRUCT)) { /* Call the constructor */
 			zend_call_method_with_0_params(Z_OBJ_P(val), ce, &ce->constructor, 0, 0);
 			if (EG(exception)) return 0;
 		}
@@ -349,7 +532,7 @@ static size_t decodeObject(const char *buf, size_t pos, size_t size, zval *val,
 	return pos;
 }
 
-static int decodeVectorItem(const char *buf, int pos, int size, zval *val, int opts, HashTable *sht, HashTable *oht, HashTable *tht, int type) {
+static size_t decodeVectorItem(const char *buf, size_t pos, size_t size, zval *val, Context *ctx, HashTable *sht, HashTable *oht, HashTable *tht, int type) {
 	switch (type) {
 		case AMF3_VECTOR_INT:
 			return decodeU32(buf, pos, size, val, 1);
@@ -358,13 +541,13 @@ static int decodeVectorItem(const char *buf, int pos, int size, zval *val, int o
 		case AMF3_VECTOR_DOUBLE:
 			return decodeDouble(buf, pos, size, val);
 		default:
-			return decodeValue(buf, pos, size, val, opts, sht, oht, tht);
+			return decodeValue(buf, pos, size, val, ctx, sht, oht, tht);
 	}
 }
 
-static size_t decodeVector(const char *buf, size_t pos, size_t size, zval *val, int opts, HashTable *sht, HashTable *oht, HashTable *tht, int type) {
+static size_t decodeVector(const char *buf, size_t pos, size_t size, zval *val, Context *ctx, HashTable *sht, HashTable *oht, HashTable *tht, int type) {
 	int len;
-	pos = decodeRef(buf, pos, size, &len, val, oht);
+	pos = decodeRef(buf, pos, size, &len, val, oht, ctx);
 	if (!pos) return 0;
 	if (len != -1) {
 		int fv;
@@ -373,26 +556,84 @@ static size_t decodeVector(const char *buf, size_t pos, size_t size, zval *val,
 		if (type == AMF3_VECTOR_OBJECT) { /* 'object-type-name' marker */
 			const char *ot;
 			int otl;
-			pos = decodeString(buf, pos, size, 0, &ot, &otl, sht, 0);
+			pos = decodeString(buf, pos, size, 0, &ot, &otl, sht, 0, ctx);
 			if (!pos) return 0;
 		}
 		array_init(val);
 		storeRef(val, oht);
 		while (len--) {
-			pos = decodeVectorItem(buf, pos, size, newHashIdx(val), opts, sht, oht, tht, type);
+			pos = decodeVectorItem(buf, pos, size, newHashIdx(val), ctx, sht, oht, tht, type);
 			if (!pos) return 0;
 		}
 	}
 	return pos;
 }
 
-static size_t decodeDictionary(const char *buf, size_t pos, size_t size, zval *val, int opts, HashTable *sht, HashTable *oht, HashTable *tht) {
-	/* No support for dictionary in PHP */
-	php_error(E_WARNING, "Unsupported 'Dictionary' value at position %zu", pos);
-	return 0;
+static int setEntry(zval *val, zval *key, zval *item) {
+	zval func, res, args[2];
+	if (Z_TYPE_P(val) == IS_ARRAY) return array_set_zval_key(Z_ARRVAL_P(val), key, item) == SUCCESS;
+	ZVAL_COPY_VALUE(&args[0], key);
+	ZVAL_COPY_VALUE(&args[1], item);
+	ZVAL_STRING(&func, "offsetSet");
+	call_user_function(0, val, &func, &res, 2, args);
+	zval_ptr_dtor(&func);
+	zval_ptr_dtor(&res);
+	return !EG(exception);
 }
 
-static size_t decodeValue(const char *buf, size_t pos, size_t size, zval *val, int opts, HashTable *sht, HashTable *oht, HashTable *tht) {
+static size_t decodeDictionary(const char *buf, size_t pos, size_t size, zval *val, Context *ctx, HashTable *sht, HashTable *oht, HashTable *tht) {
+	int len;
+	pos = decodeRef(buf, pos, size, &len, val, oht, ctx);
+	if (!pos) return 0;
+	if (len != -1) {
+		int weak, obj = -1, i;
+		zval hv, tmp, *key = 0, *item;
+		zend_reference *ref;
+		pos = decodeByte(buf, pos, size, &weak); /* 'weak-keys' marker (ignored) */
+		if (!pos) return 0;
+		ZVAL_NULL(&tmp);
+		ZVAL_NEW_REF(&hv, &tmp); /* Container type is only known once the keys are decoded */
+		ref = Z_REF(hv);
+		zend_hash_next_index_insert(oht, &hv);
+		array_init_size(&tmp, getPresize(ctx, (size_t)len << 1, size - pos)); /* Keys and values in turn */
+		for (i = 0; i < len; ++i) {
+			size_t _pos = pos;
+			pos = decodeValue(buf, pos, size, key = newHashIdx(&tmp), ctx, sht, oht, tht);
+			if (!pos) break;
+			ZVAL_DEREF(key);
+			if (Z_TYPE_P(key) == IS_OBJECT ? !obj : Z_TYPE_P(key) > IS_STRING || obj == 1) { /* Either scalar or object keys */
+				php_error(E_WARNING, "Unsupported dictionary key at position %zu", _pos);
+				pos = 0;
+				break;
+			}
+			obj = Z_TYPE_P(key) == IS_OBJECT;
+			pos = decodeValue(buf, pos, size, newHashIdx(&tmp), ctx, sht, oht, tht);
+			if (!pos) break;
+		}
+		if (pos) {
+			if (obj != 1) array_init_size(val, len);
+			else object_init_ex(val, amf3_storage_ce); /* Not a WeakMap since nothing else holds the keys */
+			key = 0;
+			ZEND_HASH_FOREACH_VAL(Z_ARRVAL(tmp), item) {
+				if (!key) {
+					key = item;
+					continue;
+				}
+				ZVAL_DEREF(key);
+				if (!setEntry(val, key, item)) {
+					pos = 0;
+					break;
+				}
+				key = 0;
+			} ZEND_HASH_FOREACH_END();
+			if (pos) ZVAL_COPY(&ref->val, val);
+		}
+		zval_ptr_dtor(&tmp);
+	}
+	return pos;
+}
+
+static size_t decodeValueData(const char *buf, size_t pos, size_t size, zval *val, Context *ctx, HashTable *sht, HashTable *oht, HashTable *tht) {
 	int type;
 	size_t _pos = pos;
 	pos = decodeByte(buf, pos, size, &type);
@@ -413,24 +654,24 @@ static size_t decodeValue(const char *buf, size_t pos, size_t size, zval *val, i
 		case AMF3_DOUBLE:
 			return decodeDouble(buf, pos, size, val);
 		case AMF3_STRING:
-			return decodeString(buf, pos, size, val, 0, 0, sht, 0);
+			return decodeString(buf, pos, size, val, 0, 0, sht, 0, ctx);
 		case AMF3_XML:
 		case AMF3_XMLDOC:
 		case AMF3_BYTEARRAY:
-			return decodeString(buf, pos, size, val, 0, 0, oht, 1);
+			return decodeString(buf, pos, size, val, 0, 0, oht, 1, ctx);
 		case AMF3_DATE:
-			return decodeDate(buf, pos, size, val, oht);
+			return decodeDate(buf, pos, size, val, oht, ctx);
 		case AMF3_ARRAY:
-			return decodeArray(buf, pos, size, val, opts, sht, oht, tht);
+			return decodeArray(buf, pos, size, val, ctx, sht, oht, tht);
 		case AMF3_OBJECT:
-			return decodeObject(buf, pos, size, val, opts, sht, oht, tht);
+			return decodeObject(buf, pos, size, val, ctx, sht, oht, tht);
 		case AMF3_VECTOR_INT:
 		case AMF3_VECTOR_UINT:
 		case AMF3_VECTOR_DOUBLE:
 		case AMF3_VECTOR_OBJECT:
-			return decodeVector(buf, pos, size, val, opts, sht, oht, tht, type);
+			return decodeVector(buf, pos, size, val, ctx, sht, oht, tht, type);
 		case AMF3_DICTIONARY:
-			return decodeDictionary(buf, pos, size, val, opts, sht, oht, tht);
+			return decodeDictionary(buf, pos, size, val, ctx, sht, oht, tht);
 		default:
 			php_error(E_WARNING, "Invalid value type %d at position %zu", type, _pos);
 			return 0;
@@ -438,6 +679,14 @@ static size_t decodeValue(const char *buf, size_t pos, size_t size, zval *val, i
 	return pos;
 }
 
+static size_t decodeValue(const char *buf, size_t pos, size_t size, zval *val, Context *ctx, HashTable *sht, HashTable *oht, HashTable *tht) {
+	if (!checkValue(ctx, pos)) return 0;
+	++ctx->lvl;
+	pos = decodeValueData(buf, pos, size, val, ctx, sht, oht, tht);
+	--ctx->lvl;
+	return pos;
+}
+
 static void freeTraits(zval *val) {
 	Traits *tr = Z_PTR_P(val);
 	if (tr->cls) zend_string_release(tr->cls);
@@ -446,33 +695,659 @@ static void freeTraits(zval *val) {
 	efree(tr);
 }
 
-PHP_FUNCTION(amf3_decode) {
-	const char *buf;
-	size_t size, pos = 0;
-	zval *pval = 0;
-	zend_long opts = 0;
+static zend_long getLimit(zend_long x) {
+	return x < 0 ? 0 : x;
+}
+
+int amf3_decode_options(zval *val, DecodeOptions *o) {
+	zend_string *key;
+	zval *item;
+	o->flags = 0;
+	o->max_depth = getLimit(AMF3_G(decode_max_depth));
+	o->max_elements = getLimit(AMF3_G(decode_max_elements));
+	o->max_bytes = getLimit(AMF3_G(decode_max_bytes));
+	o->max_refs = getLimit(AMF3_G(decode_max_refs));
+	o->max_inflated = getLimit(AMF3_G(decode_max_inflated));
+	if (!val) return 1;
+	if (Z_TYPE_P(val) != IS_ARRAY) {
+		o->flags = zval_get_long(val);
+		return 1;
+	}
+	ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(val), key, item) {
+		if (!key) {
+			php_error(E_WARNING, "Invalid option");
+			return 0;
+		}
+		if (zend_string_equals_literal(key, "flags")) o->flags = zval_get_long(item);
+		else if (zend_string_equals_literal(key, "max_depth")) o->max_depth = getLimit(zval_get_long(item));
+		else if (zend_string_equals_literal(key, "max_elements")) o->max_elements = getLimit(zval_get_long(item));
+		else if (zend_string_equals_literal(key, "max_bytes")) o->max_bytes = getLimit(zval_get_long(item));
+		else if (zend_string_equals_literal(key, "max_refs")) o->max_refs = getLimit(zval_get_long(item));
+		else if (zend_string_equals_literal(key, "max_inflated")) o->max_inflated = getLimit(zval_get_long(item));
+		else {
+			php_error(E_WARNING, "Unknown option '%s'", ZSTR_VAL(key));
+			return 0;
+		}
+	} ZEND_HASH_FOREACH_END();
+	return 1;
+}
+
+size_t amf3_decode_data(const char *buf, size_t pos, size_t size, zval *val, const DecodeOptions *o) {
+	Context ctx;
 	HashTable sht, oht, tht;
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "s|z/l", &buf, &size, &pval, &opts) == FAILURE) return;
+	if (o->flags & AMF3_DECOMPRESS) {
+		DecodeOptions uo = *o;
+		smart_str ss = {0};
+		size_t len;
+		uo.flags &= ~AMF3_DECOMPRESS;
+		if (amf3_inflate(&ss, buf + pos, size - pos, &len, o->max_inflated)
+			&& amf3_decode_data(ZSTR_VAL(ss.s), 0, ZSTR_LEN(ss.s), val, &uo)) pos += len;
+		else pos = 0;
+		smart_str_free(&ss);
+		return pos;
+	}
+	ctx.lim = o;
+	ctx.opts = o->flags;
+	ctx.lvl = 0;
+	ctx.elems = 0;
+	ctx.bytes = 0;
+	zend_hash_init(&sht, 0, 0, ZVAL_PTR_DTOR, 0);
+	zend_hash_init(&oht, 0, 0, ZVAL_PTR_DTOR, 0);
+	zend_hash_init(&tht, 0, 0, freeTraits, 0);
+	pos = decodeValue(buf, pos, size, val, &ctx, &sht, &oht, &tht);
+	zend_hash_destroy(&sht);
+	zend_hash_destroy(&oht);
+	zend_hash_destroy(&tht);
+	if (pos) return pos;
+	zval_ptr_dtor(val);
+	ZVAL_NULL(val);
+	return 0;
+}
+
+typedef struct {
+	char *buf;
+	size_t len, cap; /* In bytes */
+} Vec;
+
+typedef struct {
+	const char *str;
+	int len;
+} Str;
+
+typedef struct {
+	size_t ofs, len; /* JSON text of a complex value in the output */
+	int busy; /* Value is still being transcoded */
+} JsonRef;
+
+typedef struct {
+	int fmt, cnt;
+	Str cls;
+	size_t fld; /* Index of the first member name */
+} JsonTraits;
+
+typedef struct {
+	Context ctx;
+	const char *buf;
+	size_t size;
+	smart_str *ss;
+	Vec sht, oht, tht, fld; /* Strings, complex values, traits, member names */
+	Vec fix; /* Strings with replaced UTF-8 sequences */
+	size_t exp; /* Total length of expanded references */
+} Transcoder;
+
+static void *vecPush(Vec *v, size_t n) {
+	void *p;
+	if (v->len + n > v->cap) {
+		v->cap = v->cap ? v->cap << 1 : n << 4;
+		v->buf = erealloc(v->buf, v->cap);
+	}
+	p = v->buf + v->len;
+	v->len += n;
+	return p;
+}
+
+static void vecFree(Vec *v) {
+	if (v->buf) efree(v->buf);
+}
+
+static void jsonEscape(smart_str *ss, const char *str, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	const char *s = str, *e = str + len;
+	smart_str_appendc(ss, '"');
+	for (; str < e; ++str) {
+		unsigned char c = *str;
+		if (c >= 0x20 && c != '"' && c != '\\') continue;
+		smart_str_appendl(ss, s, str - s);
+		s = str + 1;
+		smart_str_appendc(ss, '\\');
+		switch (c) {
+			case '"':
+			case '\\':
+				smart_str_appendc(ss, c);
+				break;
+			case '\b':
+				smart_str_appendc(ss, 'b');
+				break;
+			case '\f':
+				smart_str_appendc(ss, 'f');
+				break;
+			case '\n':
+				smart_str_appendc(ss, 'n');
+				break;
+			case '\r':
+				smart_str_appendc(ss, 'r');
+				break;
+			case '\t':
+				smart_str_appendc(ss, 't');
+				break;
+			default:
+				smart_str_appendl(ss, "u00", 3);
+				smart_str_appendc(ss, hex[c >> 4]);
+				smart_str_appendc(ss, hex[c & 15]);
+				break;
+		}
+	}
+	smart_str_appendl(ss, s, e - s);
+	smart_str_appendc(ss, '"');
+}
+
+static int jsonDouble(Transcoder *t, double val, size_t pos) {
+	char num[64];
+	if (!zend_finite(val)) {
+		php_error(E_WARNING, "Non-finite number at position %zu", pos);
+		return 0;
+	}
+	php_gcvt(val, (int)PG(serialize_precision), '.', 'e', num); /* Same as json_encode() */
+	smart_str_appends(t->ss, num);
+	return 1;
+}
+
+static size_t jsonString(Transcoder *t, size_t pos, Str *str) {
+	int pfx;
+	size_t _pos = pos;
+	pos = decodeU29(t->buf, pos, t->size, &pfx);
+	if (!pos) return 0;
+	if (pfx & 1) {
+		zend_string *fix;
+		pfx >>= 1;
+		if (pos + pfx > t->size) {
+			php_error(E_WARNING, "Insufficient data of length %d at position %zu", pfx, pos);
+			return 0;
+		}
+		if (pfx && !checkRef(&t->ctx, t->sht.len / sizeof *str, _pos)) return 0;
+		if (!validUtf8(&t->ctx, t->buf + pos, pfx, pos, &fix)) return 0;
+		if (fix) {
+			*(zend_string **)vecPush(&t->fix, sizeof fix) = fix;
+			str->str = ZSTR_VAL(fix);
+			str->len = ZSTR_LEN(fix);
+		} else {
+			str->str = t->buf + pos;
+			str->len = pfx;
+		}
+		pos += pfx;
+		if (pfx) *(Str *)vecPush(&t->sht, sizeof *str) = *str; /* Empty string is never sent by reference */
+	} else {
+		pfx >>= 1;
+		if ((size_t)pfx >= t->sht.len / sizeof *str) {
+			php_error(E_WARNING, "Invalid reference %d at position %zu", pfx, _pos);
+			return 0;
+		}
+		*str = ((Str *)t->sht.buf)[pfx];
+	}
+	return checkBytes(&t->ctx, str->len, _pos) ? pos : 0;
+}
+
+static size_t jsonRef(Transcoder *t, size_t pos, int *num) {
+	smart_str *ss = t->ss;
+	JsonRef *ref;
+	int pfx;
+	size_t _pos = pos;
+	pos = decodeU29(t->buf, pos, t->size, &pfx);
+	if (!pos) return 0;
+	if (pfx & 1) {
+		*num = pfx >> 1;
+		return checkRef(&t->ctx, t->oht.len / sizeof *ref, _pos) ? pos : 0;
+	}
+	pfx >>= 1;
+	if ((size_t)pfx >= t->oht.len / sizeof *ref) {
+		php_error(E_WARNING, "Invalid reference %d at position %zu", pfx, _pos);
+		return 0;
+	}
+	ref = (JsonRef *)t->oht.buf + pfx;
+	if (ref->busy) {
+		php_error(E_WARNING, "Circular reference %d at position %zu", pfx, _pos);
+		return 0;
+	}
+	if (!checkBytes(&t->ctx, ref->len, _pos)) return 0;
+	if (!t->ctx.lim->max_bytes && (t->exp += ref->len) > (t->size + 1024) * REFEXPAND) {
+		php_error(E_WARNING, "Reference expansion limit exceeded at position %zu", _pos);
+		return 0;
+	}
+	smart_str_alloc(ss, ref->len, 0); /* Expand reference by copying its JSON text */
+	memcpy(ZSTR_VAL(ss->s) + ZSTR_LEN(ss->s), ZSTR_VAL(ss->s) + ref->ofs, ref->len);
+	ZSTR_LEN(ss->s) += ref->len;
+	*num = -1;
+	return pos;
+}
+
+static size_t newRef(Transcoder *t) {
+	JsonRef *ref = vecPush(&t->oht, sizeof *ref);
+	ref->ofs = t->ss->s ? ZSTR_LEN(t->ss->s) : 0;
+	ref->len = 0;
+	ref->busy = 1;
+	return t->oht.len / sizeof *ref - 1;
+}
+
+static void endRef(Transcoder *t, size_t idx) {
+	JsonRef *ref = (JsonRef *)t->oht.buf + idx;
+	ref->len = ZSTR_LEN(t->ss->s) - ref->ofs;
+	ref->busy = 0;
+}
+
+static size_t jsonValue(Transcoder *t, size_t pos);
+
+static size_t jsonBytes(Transcoder *t, size_t pos) {
+	int len;
+	size_t idx, n, _pos = pos;
+	zend_string *fix = 0;
+	pos = jsonRef(t, pos, &len);
+	if (!pos || len == -1) return pos;
+	if (pos + len > t->size) {
+		php_error(E_WARNING, "Insufficient data of length %d at position %zu", len, pos);
+		return 0;
+	}
+	if (!checkBytes(&t->ctx, len, _pos)) return 0;
+	if ((n = checkUtf8(t->buf + pos, len)) != (size_t)len) { /* Binary data is always checked since JSON can't hold it */
+		if (!(t->ctx.opts & AMF3_UTF8_REPLACE)) {
+			php_error(E_WARNING, "Invalid UTF-8 sequence at position %zu", pos + n);
+			return 0;
+		}
+		fix = fixUtf8(t->buf + pos, len, n);
+	}
+	idx = newRef(t);
+	if (!fix) jsonEscape(t->ss, t->buf + pos, len);
+	else {
+		jsonEscape(t->ss, ZSTR_VAL(fix), ZSTR_LEN(fix));
+		zend_string_release(fix);
+	}
+	endRef(t, idx);
+	return pos + len;
+}
+
+static size_t jsonDate(Transcoder *t, size_t pos) {
+	int pfx;
+	size_t idx, _pos = pos;
+	zval hv;
+	pos = jsonRef(t, pos, &pfx);
+	if (!pos || pfx == -1) return pos;
+	pos = decodeDouble(t->buf, pos, t->size, &hv);
+	if (!pos) return 0;
+	idx = newRef(t);
+	if (!jsonDouble(t, Z_DVAL(hv), _pos)) return 0;
+	endRef(t, idx);
+	return pos;
+}
+
+static size_t jsonArray(Transcoder *t, size_t pos) {
+	smart_str *ss = t->ss;
+	int len, obj, i;
+	size_t idx;
+	Str key;
+	pos = jsonRef(t, pos, &len);
+	if (!pos || len == -1) return pos;
+	idx = newRef(t);
+	pos = jsonString(t, pos, &key);
+	if (!pos) return 0;
+	obj = key.len != 0; /* Associative portion makes a JSON object */
+	smart_str_appendc(ss, obj ? '{' : '[');
+	while (key.len) {
+		jsonEscape(ss, key.str, key.len);
+		smart_str_appendc(ss, ':');
+		pos = jsonValue(t, pos);
+		if (!pos) return 0;
+		pos = jsonString(t, pos, &key);
+		if (!pos) return 0;
+		if (key.len || len) smart_str_appendc(ss, ',');
+	}
+	for (i = 0; i < len; ++i) {
+		if (i) smart_str_appendc(ss, ',');
+		if (obj) {
+			smart_str_appendc(ss, '"');
+			smart_str_append_long(ss, i);
+			smart_str_appendl(ss, "\":", 2);
+		}
+		pos = jsonValue(t, pos);
+		if (!pos) return 0;
+	}
+	smart_str_appendc(ss, obj ? '}' : ']');
+	endRef(t, idx);
+	return pos;
+}
+
+static size_t jsonObject(Transcoder *t, size_t pos) {
+	smart_str *ss = t->ss;
+	JsonTraits tr;
+	Str key;
+	int pfx, def, i, first;
+	size_t idx, _pos = pos;
+	pos = jsonRef(t, pos, &pfx);
+	if (!pos || pfx == -1) return pos;
+	idx = newRef(t);
+	def = pfx & 1;
+	pfx >>= 1;
+	if (def) { /* New class definition */
+		int n = pfx >> 2;
+		if (!checkRef(&t->ctx, t->tht.len / sizeof tr, _pos)) return 0;
+		pos = jsonString(t, pos, &tr.cls); /* Class name */
+		if (!pos) return 0;
+		if (n > 0 && pos + n > t->size) {
+			php_error(E_WARNING, "Invalid number of class members %d at position %zu", n, _pos);
+			return 0;
+		}
+		tr.fmt = pfx & 3;
+		tr.cnt = n;
+		tr.fld = t->fld.len / sizeof key;
+		for (i = 0; i < n; ++i) { /* Static member names */
+			size_t __pos = pos;
+			pos = jsonString(t, pos, &key);
+			if (!pos) return 0;
+			if (!key.len || !key.str[0]) {
+				php_error(E_WARNING, "Invalid class member name at position %zu", __pos);
+				return 0;
+			}
+			*(Str *)vecPush(&t->fld, sizeof key) = key;
+		}
+		*(JsonTraits *)vecPush(&t->tht, sizeof tr) = tr;
+	} else if ((size_t)pfx < t->tht.len / sizeof tr) tr = ((JsonTraits *)t->tht.buf)[pfx]; /* Existing class definition */
+	else {
+		php_error(E_WARNING, "Invalid class reference %d at position %zu", pfx, _pos);
+		return 0;
+	}
+	smart_str_appendc(ss, '{');
+	if (tr.fmt & 1) { /* Externalizable */
+		smart_str_appendl(ss, "\"__data\":", sizeof "\"__data\":" - 1);
+		pos = jsonValue(t, pos);
+		if (!pos) return 0;
+		first = 0;
+	} else {
+		for (i = 0; i < tr.cnt; ++i) {
+			key = ((Str *)t->fld.buf)[tr.fld + i];
+			if (i) smart_str_appendc(ss, ',');
+			jsonEscape(ss, key.str, key.len);
+			smart_str_appendc(ss, ':');
+			pos = jsonValue(t, pos);
+			if (!pos) return 0;
+		}
+		first = !tr.cnt;
+		if (tr.fmt & 2) { /* Dynamic */
+			for (;;) {
+				pos = jsonString(t, pos, &key);
+				if (!pos) return 0;
+				if (!key.len) break;
+				if (!first) smart_str_appendc(ss, ',');
+				first = 0;
+				jsonEscape(ss, key.str, key.len);
+				smart_str_appendc(ss, ':');
+				pos = jsonValue(t, pos);
+				if (!pos) return 0;
+			}
+		}
+	}
+	if (tr.cls.len) {
+		if (!first) smart_str_appendc(ss, ',');
+		smart_str_appendl(ss, "\"__class\":", sizeof "\"__class\":" - 1);
+		jsonEscape(ss, tr.cls.str, tr.cls.len);
+	}
+	smart_str_appendc(ss, '}');
+	endRef(t, idx);
+	return pos;
+}
+
+static size_t jsonVector(Transcoder *t, size_t pos, int type) {
+	smart_str *ss = t->ss;
+	int len, fv, i;
+	size_t idx;
+	pos = jsonRef(t, pos, &len);
+	if (!pos || len == -1) return pos;
+	pos = decodeByte(t->buf, pos, t->size, &fv); /* 'fixed-vector' marker */
+	if (!pos) return 0;
+	if (type == AMF3_VECTOR_OBJECT) { /* 'object-type-name' marker */
+		Str ot;
+		pos = jsonString(t, pos, &ot);
+		if (!pos) return 0;
+	}
+	idx = newRef(t);
+	smart_str_appendc(ss, '[');
+	for (i = 0; i < len; ++i) {
+		size_t _pos = pos;
+		zval hv;
+		if (i) smart_str_appendc(ss, ',');
+		switch (type) {
+			case AMF3_VECTOR_INT:
+			case AMF3_VECTOR_UINT:
+				pos = decodeU32(t->buf, pos, t->size, &hv, type == AMF3_VECTOR_INT);
+				if (pos) smart_str_append_long(ss, Z_LVAL(hv));
+				break;
+			case AMF3_VECTOR_DOUBLE:
+				pos = decodeDouble(t->buf, pos, t->size, &hv);
+				if (pos && !jsonDouble(t, Z_DVAL(hv), _pos)) pos = 0;
+				break;
+			default:
+				pos = jsonValue(t, pos);
+				break;
+		}
+		if (!pos) return 0;
+	}
+	smart_str_appendc(ss, ']');
+	endRef(t, idx);
+	return pos;
+}
+
+static size_t jsonKey(Transcoder *t, size_t pos) {
+	smart_str *ss = t->ss;
+	int type;
+	size_t _pos = pos;
+	zval hv;
+	Str key;
+	if (!checkValue(&t->ctx, pos)) return 0;
+	pos = decodeByte(t->buf, pos, t->size, &type);
+	if (!pos) return 0;
+	switch (type) { /* Same conversion as for PHP array keys */
+		case AMF3_UNDEFINED:
+		case AMF3_NULL:
+			smart_str_appendl(ss, "\"\"", 2);
+			break;
+		case AMF3_FALSE:
+			smart_str_appendl(ss, "\"0\"", 3);
+			break;
+		case AMF3_TRUE:
+			smart_str_appendl(ss, "\"1\"", 3);
+			break;
+		case AMF3_INTEGER:
+		case AMF3_DOUBLE:
+			pos = type == AMF3_INTEGER ? decodeInteger(t->buf, pos, t->size, &hv) : decodeDouble(t->buf, pos, t->size, &hv);
+			if (!pos) return 0;
+			smart_str_appendc(ss, '"');
+			smart_str_append_long(ss, Z_TYPE(hv) == IS_LONG ? Z_LVAL(hv) : zend_dval_to_lval(Z_DVAL(hv)));
+			smart_str_appendc(ss, '"');
+			break;
+		case AMF3_STRING:
+			pos = jsonString(t, pos, &key);
+			if (!pos) return 0;
+			jsonEscape(ss, key.str, key.len);
+			break;
+		default:
+			php_error(E_WARNING, "Unsupported dictionary key at position %zu", _pos);
+			return 0;
+	}
+	smart_str_appendc(ss, ':');
+	return pos;
+}
+
+static size_t jsonDictionary(Transcoder *t, size_t pos) {
+	smart_str *ss = t->ss;
+	int len, weak, i;
+	size_t idx;
+	pos = jsonRef(t, pos, &len);
+	if (!pos || len == -1) return pos;
+	pos = decodeByte(t->buf, pos, t->size, &weak); /* 'weak-keys' marker */
+	if (!pos) return 0;
+	idx = newRef(t);
+	smart_str_appendc(ss, '{');
+	for (i = 0; i < len; ++i) {
+		if (i) smart_str_appendc(ss, ',');
+		pos = jsonKey(t, pos);
+		if (!pos) return 0;
+		pos = jsonValue(t, pos);
+		if (!pos) return 0;
+	}
+	smart_str_appendc(ss, '}');
+	endRef(t, idx);
+	return pos;
+}
+
+static size_t jsonValueData(Transcoder *t, size_t pos) {
+	smart_str *ss = t->ss;
+	int type;
+	size_t _pos = pos;
+	zval hv;
+	Str str;
+	pos = decodeByte(t->buf, pos, t->size, &type);
+	if (!pos) return 0;
+	switch (type) {
+		case AMF3_UNDEFINED:
+		case AMF3_NULL:
+			smart_str_appendl(ss, "null", 4);
+			break;
+		case AMF3_FALSE:
+			smart_str_appendl(ss, "false", 5);
+			break;
+		case AMF3_TRUE:
+			smart_str_appendl(ss, "true", 4);
+			break;
+		case AMF3_INTEGER:
+			pos = decodeInteger(t->buf, pos, t->size, &hv);
+			if (pos) smart_str_append_long(ss, Z_LVAL(hv));
+			break;
+		case AMF3_DOUBLE:
+			pos = decodeDouble(t->buf, pos, t->size, &hv);
+			if (pos && !jsonDouble(t, Z_DVAL(hv), _pos)) return 0;
+			break;
+		case AMF3_STRING:
+			pos = jsonString(t, pos, &str);
+			if (pos) jsonEscape(ss, str.str, str.len);
+			break;
+		case AMF3_XML:
+		case AMF3_XMLDOC:
+		case AMF3_BYTEARRAY:
+			return jsonBytes(t, pos);
+		case AMF3_DATE:
+			return jsonDate(t, pos);
+		case AMF3_ARRAY:
+			return jsonArray(t, pos);
+		case AMF3_OBJECT:
+			return jsonObject(t, pos);
+		case AMF3_VECTOR_INT:
+		case AMF3_VECTOR_UINT:
+		case AMF3_VECTOR_DOUBLE:
+		case AMF3_VECTOR_OBJECT:
+			return jsonVector(t, pos, type);
+		case AMF3_DICTIONARY:
+			return jsonDictionary(t, pos);
+		default:
+			php_error(E_WARNING, "Invalid value type %d at position %zu", type, _pos);
+			return 0;
+	}
+	return pos;
+}
+
+static size_t jsonValue(Transcoder *t, size_t pos) {
+	if (!checkValue(&t->ctx, pos)) return 0;
+	++t->ctx.lvl;
+	pos = jsonValueData(t, pos);
+	--t->ctx.lvl;
+	return pos;
+}
+
+static size_t transcode(smart_str *ss, const char *buf, size_t pos, size_t size, const DecodeOptions *o) {
+	Transcoder t;
+	if (o->flags & AMF3_DECOMPRESS) {
+		DecodeOptions uo = *o;
+		smart_str zs = {0};
+		size_t len;
+		uo.flags &= ~AMF3_DECOMPRESS;
+		if (amf3_inflate(&zs, buf + pos, size - pos, &len, o->max_inflated)
+			&& transcode(ss, ZSTR_VAL(zs.s), 0, ZSTR_LEN(zs.s), &uo)) pos += len;
+		else pos = 0;
+		smart_str_free(&zs);
+		return pos;
+	}
+	memset(&t, 0, sizeof t);
+	t.ctx.lim = o;
+	t.ctx.opts = o->flags;
+	t.buf = buf;
+	t.size = size;
+	t.ss = ss;
+	pos = jsonValue(&t, pos);
+	vecFree(&t.sht);
+	vecFree(&t.oht);
+	vecFree(&t.tht);
+	vecFree(&t.fld);
+	while (t.fix.len) {
+		t.fix.len -= sizeof(zend_string *);
+		zend_string_release(*(zend_string **)(t.fix.buf + t.fix.len));
+	}
+	vecFree(&t.fix);
+	return pos;
+}
+
+static int getArgs(zval *pval, zval *zopts, size_t size, size_t *pos, DecodeOptions *opts) {
+	if (!amf3_decode_options(zopts, opts)) {
+		if (pval) {
+			zval_ptr_dtor(pval);
+			ZVAL_LONG(pval, -1);
+		}
+		return 0;
+	}
 	if (pval) {
 		if (Z_TYPE_P(pval) == IS_LONG) {
-			pos = Z_LVAL_P(pval);
-			if (pos > size) {
+			*pos = Z_LVAL_P(pval);
+			if (*pos > size) {
 				php_error(E_WARNING, "Position out of range");
 				ZVAL_LONG(pval, -1);
-				return;
+				return 0;
 			}
 		}
 		zval_ptr_dtor(pval);
 	}
-	zend_hash_init(&sht, 0, 0, ZVAL_PTR_DTOR, 0);
-	zend_hash_init(&oht, 0, 0, ZVAL_PTR_DTOR, 0);
-	zend_hash_init(&tht, 0, 0, freeTraits, 0);
-	pos = decodeValue(buf, pos, size, return_value, opts, &sht, &oht, &tht);
-	zend_hash_destroy(&sht);
-	zend_hash_destroy(&oht);
-	zend_hash_destroy(&tht);
+	return 1;
+}
+
+PHP_FUNCTION(amf3_decode) {
+	const char *buf;
+	size_t size, pos = 0;
+	zval *pval = 0, *zopts = 0;
+	DecodeOptions opts;
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "s|z/z", &buf, &size, &pval, &zopts) == FAILURE) return;
+	if (!getArgs(pval, zopts, size, &pos, &opts)) return;
+	pos = amf3_decode_data(buf, pos, size, return_value, &opts);
 	if (pval) ZVAL_LONG(pval, pos ? pos : -1);
-	if (pos) return;
-	zval_ptr_dtor(return_value);
-	ZVAL_NULL(return_value);
+}
+
+PHP_FUNCTION(amf3_to_json) {
+	const char *buf;
+	size_t size, pos = 0;
+	zval *pval = 0, *zopts = 0;
+	DecodeOptions opts;
+	smart_str ss = {0};
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "s|z/z", &buf, &size, &pval, &zopts) == FAILURE) return;
+	if (!getArgs(pval, zopts, size, &pos, &opts)) RETURN_FALSE;
+	pos = transcode(&ss, buf, pos, size, &opts);
+	if (pval) ZVAL_LONG(pval, pos ? pos : -1);
+	if (!pos) {
+		smart_str_free(&ss);
+		RETURN_FALSE;
+	}
+	smart_str_0(&ss);
+	RETURN_STR(ss.s);
 }
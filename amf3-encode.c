@@ -27,12 +27,31 @@
 #include "php.h"
 #include "php_amf3.h"
 #include "zend_smart_str.h"
+#include "zend_interfaces.h"
+#include "zend_exceptions.h"
 #include "amf3.h"
 
-#define MAXDEPTH 100 /* Arbitrary call depth limit for recursion check */
+#define INTBLOCK 64 /* Number of integers to reserve space for at once in dense arrays */
+#define ZCHUNK 65536 /* Amount of new output to collect before compressing what is final */
 
-static void encodeU29(smart_str *ss, int val) {
-	char buf[4];
+typedef struct {
+	HashTable ht;
+	int cnt; /* Number of strings sent by value */
+	int min, max, ident; /* Reference policy */
+	int refs; /* Number of strings sent by reference */
+} StrRefs;
+
+typedef struct {
+	zend_string *str;
+	int idx;
+} StrRef;
+
+typedef struct {
+	HashTable ht;
+	int cnt; /* Number of containers sent by value */
+} ObjRefs;
+
+static int packU29(char *buf, int val) {
 	int len;
 	val &= 0x1fffffff;
 	if (val <= 0x7f) {
@@ -54,7 +73,22 @@ static void encodeU29(smart_str *ss, int val) {
 		buf[3] = val;
 		len = 4;
 	}
-	smart_str_appendl(ss, buf, len);
+	return len;
+}
+
+static void encodeU29(smart_str *ss, int val) {
+	char buf[4];
+	smart_str_appendl(ss, buf, packU29(buf, val));
+}
+
+static void insertU29(smart_str *ss, size_t ofs, int val) {
+	char buf[4], *str;
+	int len = packU29(buf, val);
+	smart_str_alloc(ss, len, 0);
+	str = ZSTR_VAL(ss->s) + ofs;
+	memmove(str + len, str, ZSTR_LEN(ss->s) - ofs);
+	memcpy(str, buf, len);
+	ZSTR_LEN(ss->s) += len;
 }
 
 static void encodeDouble(smart_str *ss, double val) {
@@ -71,79 +105,155 @@ static void encodeDouble(smart_str *ss, double val) {
 	smart_str_appendl(ss, buf, 8);
 }
 
-static int encodeRefEx(smart_str *ss, const char *str, size_t len, HashTable *ht) {
-	int *oidx, nidx;
-	if ((oidx = zend_hash_str_find_ptr(ht, str, len))) {
+static int encodeRef(smart_str *ss, void *ptr, int reg, ObjRefs *os) {
+	int *oidx;
+	if ((oidx = zend_hash_index_find_ptr(&os->ht, (zend_ulong)(uintptr_t)ptr))) {
 		encodeU29(ss, *oidx << 1);
 		return 1;
 	}
-	nidx = zend_hash_num_elements(ht);
-	if (nidx <= AMF3_INT_MAX) zend_hash_str_add_mem(ht, str, len, &nidx, sizeof nidx);
+	if (reg && os->cnt <= AMF3_INT_MAX) zend_hash_index_add_mem(&os->ht, (zend_ulong)(uintptr_t)ptr, &os->cnt, sizeof os->cnt);
+	++os->cnt; /* Every container sent by value can be referenced by the decoder */
 	return 0;
 }
 
-static int encodeRef(smart_str *ss, void *ptr, HashTable *ht) {
-	return encodeRefEx(ss, (char *)&ptr, sizeof ptr, ht);
+static int encodeStrRef(smart_str *ss, const char *str, size_t len, zend_string *zs, StrRefs *sr) {
+	int nidx = sr->cnt, *oidx = 0;
+	StrRef *ref;
+	if (!len) return 0; /* Empty string is never sent by reference */
+	if (len >= (size_t)sr->min) {
+		if (!sr->ident) oidx = zend_hash_str_find_ptr(&sr->ht, str, len);
+		else if (zs && (ref = zend_hash_index_find_ptr(&sr->ht, (zend_ulong)(uintptr_t)zs))) oidx = &ref->idx;
+		if (oidx) {
+			encodeU29(ss, *oidx << 1);
+			++sr->refs;
+			return 1;
+		}
+		if (nidx <= AMF3_INT_MAX && (!sr->max || zend_hash_num_elements(&sr->ht) < (uint32_t)sr->max)) {
+			if (!sr->ident) zend_hash_str_add_mem(&sr->ht, str, len, &nidx, sizeof nidx);
+			else if (zs) { /* String is held until the end so that its address can't be reused */
+				ref = emalloc(sizeof *ref);
+				ref->str = zend_string_copy(zs);
+				ref->idx = nidx;
+				zend_hash_index_add_new_ptr(&sr->ht, (zend_ulong)(uintptr_t)zs, ref);
+			}
+		}
+	}
+	++sr->cnt; /* Every non-empty string sent by value can be referenced by the decoder */
+	return 0;
 }
 
-static void encodeString(smart_str *ss, const char *str, size_t len, HashTable *ht) {
-	if (len > AMF3_INT_MAX) len = AMF3_INT_MAX;
-	if (len && encodeRefEx(ss, str, len, ht)) return; /* Empty string is never sent by reference */
+static void encodeStringEx(smart_str *ss, const char *str, size_t len, zend_string *zs, StrRefs *sr) {
+	if (len > AMF3_INT_MAX) {
+		len = AMF3_INT_MAX;
+		zs = 0;
+	}
+	if (encodeStrRef(ss, str, len, zs, sr)) return;
 	encodeU29(ss, (len << 1) | 1);
 	smart_str_appendl(ss, str, len);
 }
 
-static void encodeValue(smart_str *ss, zval *val, int opts, HashTable *sht, HashTable *oht, HashTable *tht, int lvl);
+static void encodeString(smart_str *ss, zend_string *str, StrRefs *sr) {
+	encodeStringEx(ss, ZSTR_VAL(str), ZSTR_LEN(str), str, sr);
+}
 
-static void encodeHash(smart_str *ss, HashTable *ht, int opts, HashTable *sht, HashTable *oht, HashTable *tht, int lvl, int obj) {
-	zend_ulong idx;
-	zend_string *key;
-	zval *val;
-	ZEND_HASH_FOREACH_KEY_VAL(ht, idx, key, val) {
-		if (key) {
-			const char *str = ZSTR_VAL(key);
-			size_t len = ZSTR_LEN(key);
-			if (!len) continue; /* Empty key can't be represented in AMF3 */
-			if (obj && !str[0]) continue; /* Skip private/protected property */
-			encodeString(ss, str, len, sht);
-		} else {
-			char buf[22];
-			encodeString(ss, buf, sprintf(buf, "%ld", idx), sht);
-		}
-		encodeValue(ss, val, opts, sht, oht, tht, lvl + 1);
-	} ZEND_HASH_FOREACH_END();
-	smart_str_appendc(ss, 0x01);
+enum { FRAME_ARRAY, FRAME_HASH, FRAME_TRAVERSABLE, FRAME_DICTIONARY };
+
+typedef struct {
+	int type;
+	int obj, assoc; /* Hash of object properties, associative traversable */
+	int tmp; /* Container may be freed once its frame is popped */
+	int len, n, next, half; /* Iterator state */
+	zval val; /* Container being encoded */
+	zval key, item; /* Dictionary entry being encoded */
+	HashTable *ht;
+	HashPosition pos;
+	zend_object_iterator *it;
+	size_t ofs; /* Where to insert the length of a dense traversable */
+} Frame;
+
+typedef struct {
+	smart_str *ss;
+	smart_str *out; /* Compressed output */
+	void *zd; /* Compression stream */
+	size_t base, mark; /* Length of output already compressed, when to compress next */
+	int opts, max, err; /* Flags, depth limit, error flag */
+	int tmp; /* Value being encoded is only held for the duration of its frame */
+	StrRefs sht;
+	ObjRefs oht;
+	HashTable tht;
+	Frame *stk; /* Explicit stack of containers being encoded */
+	int top, cap;
+} Context;
+
+static void growStack(Context *ctx) {
+	ctx->cap = ctx->cap ? ctx->cap << 1 : 16;
+	ctx->stk = erealloc(ctx->stk, ctx->cap * sizeof *ctx->stk);
+}
+
+static Frame *pushFrame(Context *ctx, int type, zval *val) {
+	Frame *f;
+	if (ctx->top == ctx->cap) growStack(ctx);
+	f = ctx->stk + ctx->top++;
+	f->type = type;
+	f->obj = f->assoc = f->len = f->n = f->next = f->half = 0;
+	f->tmp = ctx->tmp;
+	ZVAL_COPY(&f->val, val);
+	ZVAL_UNDEF(&f->key);
+	ZVAL_UNDEF(&f->item);
+	f->ht = 0;
+	f->it = 0;
+	return f;
+}
+
+static void popFrame(Context *ctx) {
+	Frame *f = ctx->stk + --ctx->top;
+	if (f->tmp) { /* Address can be reused once the container is freed */
+		void *ptr = f->ht ? (void *)f->ht : (void *)Z_OBJ(f->val);
+		zend_hash_index_del(&ctx->oht.ht, (zend_ulong)(uintptr_t)ptr);
+	}
+	if (f->it) zend_iterator_dtor(f->it);
+	zval_ptr_dtor(&f->key);
+	zval_ptr_dtor(&f->item);
+	zval_ptr_dtor(&f->val);
+}
+
+static void pushHash(Context *ctx, zval *val, int type, int obj) {
+	Frame *f = pushFrame(ctx, type, val);
+	f->ht = HASH_OF(val);
+	f->obj = obj;
+	zend_hash_internal_pointer_reset_ex(f->ht, &f->pos);
 }
 
-static void encodeArray(smart_str *ss, zval *val, int opts, HashTable *sht, HashTable *oht, HashTable *tht, int lvl, int len) {
-	HashTable *ht = HASH_OF(val);
-	if (encodeRef(ss, ht, oht)) return;
+static void encodeArray(Context *ctx, zval *val, int len) {
+	smart_str *ss = ctx->ss;
+	if (encodeRef(ss, HASH_OF(val), !ctx->tmp || len, &ctx->oht)) return; /* Empty array has no frame to unregister it */
 	if (len != -1) { /* Encode as dense array */
 		encodeU29(ss, (len << 1) | 1);
 		smart_str_appendc(ss, 0x01);
-		ZEND_HASH_FOREACH_VAL(ht, val) {
-			encodeValue(ss, val, opts, sht, oht, tht, lvl + 1);
-		} ZEND_HASH_FOREACH_END();
+		if (len) pushHash(ctx, val, FRAME_ARRAY, 0);
 	} else { /* Encode as associative array */
 		smart_str_appendc(ss, 0x01);
-		encodeHash(ss, ht, opts, sht, oht, tht, lvl, 0);
+		pushHash(ctx, val, FRAME_HASH, 0);
 	}
 }
 
-static void encodeObject(smart_str *ss, zval *val, int opts, HashTable *sht, HashTable *oht, HashTable *tht, int lvl) {
-	HashTable *ht = HASH_OF(val);
-	zend_class_entry *ce = Z_TYPE_P(val) == IS_OBJECT ? Z_OBJCE_P(val) : zend_standard_class_def;
+static void encodeTraits(smart_str *ss, zend_class_entry *ce, StrRefs *sht, HashTable *tht) {
 	int *oidx, nidx;
-	if (encodeRef(ss, ht, oht)) return;
 	if ((oidx = zend_hash_str_find_ptr(tht, (char *)&ce, sizeof ce))) encodeU29(ss, (*oidx << 2) | 1);
 	else {
 		nidx = zend_hash_num_elements(tht);
 		if (nidx <= AMF3_INT_MAX) zend_hash_str_add_mem(tht, (char *)&ce, sizeof ce, &nidx, sizeof nidx);
 		smart_str_appendc(ss, 0x0b);
 		if (ce == zend_standard_class_def) smart_str_appendc(ss, 0x01); /* Anonymous object */
-		else encodeString(ss, ZSTR_VAL(ce->name), ZSTR_LEN(ce->name), sht); /* Typed object */
+		else encodeString(ss, ce->name, sht); /* Typed object */
 	}
-	encodeHash(ss, ht, opts, sht, oht, tht, lvl, 1);
+}
+
+static void encodeObject(Context *ctx, zval *val) {
+	zend_class_entry *ce = Z_TYPE_P(val) == IS_OBJECT ? Z_OBJCE_P(val) : zend_standard_class_def;
+	if (encodeRef(ctx->ss, HASH_OF(val), 1, &ctx->oht)) return;
+	encodeTraits(ctx->ss, ce, &ctx->sht, &ctx->tht);
+	pushHash(ctx, val, FRAME_HASH, 1);
 }
 
 static int getArrayLength(zval *val) {
@@ -156,7 +266,203 @@ static int getArrayLength(zval *val) {
 	return len;
 }
 
-static void encodeValueData(smart_str *ss, zval *val, int opts, HashTable *sht, HashTable *oht, HashTable *tht, int lvl) {
+static int encodeKey(smart_str *ss, zval *key, StrRefs *sht) {
+	zend_string *str = zval_get_string(key);
+	size_t len = ZSTR_LEN(str);
+	if (len) encodeString(ss, str, sht); /* Empty key can't be represented in AMF3 */
+	zend_string_release(str);
+	return len != 0;
+}
+
+static void callMethod(zval *obj, const char *name, zval *res) {
+	zval func;
+	ZVAL_STRING(&func, name);
+	call_user_function(0, obj, &func, res, 0, 0);
+	zval_ptr_dtor(&func);
+}
+
+static int getCount(zval *val) {
+	zval res;
+	zend_long len;
+	if (!instanceof_function(Z_OBJCE_P(val), zend_ce_countable)) return -1;
+	callMethod(val, "count", &res);
+	len = EG(exception) ? -1 : zval_get_long(&res);
+	zval_ptr_dtor(&res);
+	return len >= 0 && len < AMF3_INT_MAX ? len : -1;
+}
+
+static void encodeTraversable(Context *ctx, zval *val) {
+	smart_str *ss = ctx->ss;
+	zend_class_entry *ce = Z_OBJCE_P(val);
+	zend_object_iterator *it;
+	int assoc = ctx->opts & AMF3_TRAVERSABLE_ASSOC, obj = assoc && (ctx->opts & AMF3_FORCE_OBJECT), len = -1;
+	size_t ofs = 0;
+	Frame *f;
+	smart_str_appendc(ss, obj ? AMF3_OBJECT : AMF3_ARRAY);
+	if (encodeRef(ss, Z_OBJ_P(val), 1, &ctx->oht)) return;
+	if (obj) encodeTraits(ss, zend_standard_class_def, &ctx->sht, &ctx->tht); /* Encode as anonymous object */
+	else if (assoc) smart_str_appendc(ss, 0x01); /* Encode as associative array */
+	else { /* Encode as dense array */
+		len = getCount(val);
+		if (EG(exception)) return;
+		if (len != -1) encodeU29(ss, (len << 1) | 1); /* Length is known in advance */
+		ofs = ctx->base + ZSTR_LEN(ss->s); /* Otherwise, it is inserted here afterwards */
+		smart_str_appendc(ss, 0x01);
+	}
+	if (!(it = ce->get_iterator(ce, val, 0))) return;
+	it->index = 0;
+	f = pushFrame(ctx, FRAME_TRAVERSABLE, val);
+	f->it = it;
+	f->assoc = assoc;
+	f->len = len;
+	f->ofs = ofs;
+	if (it->funcs->rewind) it->funcs->rewind(it);
+}
+
+static int isDictionary(zend_class_entry *ce) {
+	return (amf3_storage_ce && instanceof_function(ce, amf3_storage_ce)) || (amf3_weakmap_ce && ce == amf3_weakmap_ce);
+}
+
+static void encodeDictionary(Context *ctx, zval *val) {
+	smart_str *ss = ctx->ss;
+	zend_class_entry *ce = Z_OBJCE_P(val);
+	zend_object_iterator *it;
+	int len;
+	Frame *f;
+	smart_str_appendc(ss, AMF3_DICTIONARY);
+	if (encodeRef(ss, Z_OBJ_P(val), 1, &ctx->oht)) return;
+	len = getCount(val);
+	if (EG(exception)) return;
+	if (len == -1) {
+		zend_throw_exception_ex(zend_ce_exception, 0, "Dictionary is too large");
+		return;
+	}
+	encodeU29(ss, (len << 1) | 1);
+	smart_str_appendc(ss, ce == amf3_weakmap_ce); /* 'weak-keys' marker */
+	if (!(it = ce->get_iterator(ce, val, 0))) return;
+	it->index = 0;
+	f = pushFrame(ctx, FRAME_DICTIONARY, val);
+	f->it = it;
+	f->len = len;
+	if (it->funcs->rewind) it->funcs->rewind(it);
+}
+
+static zval *nextArrayItem(Context *ctx, Frame *f) {
+	smart_str *ss = ctx->ss;
+	char *p = 0, *e = 0;
+	int fast = !ctx->max || ctx->top < ctx->max; /* Items are within the depth limit */
+	zval *val;
+	while ((val = zend_hash_get_current_data_ex(f->ht, &f->pos))) {
+		zend_hash_move_forward_ex(f->ht, &f->pos);
+		if (!fast || Z_TYPE_P(val) != IS_LONG || Z_LVAL_P(val) < AMF3_INT_MIN || Z_LVAL_P(val) > AMF3_INT_MAX) break;
+		if (e - p < 5) { /* Reserve space for a block of integers (marker + U29) */
+			if (p) ZSTR_LEN(ss->s) = p - ZSTR_VAL(ss->s);
+			smart_str_alloc(ss, INTBLOCK * 5, 0);
+			p = ZSTR_VAL(ss->s) + ZSTR_LEN(ss->s);
+			e = p + INTBLOCK * 5;
+		}
+		*p++ = AMF3_INTEGER;
+		p += packU29(p, Z_LVAL_P(val));
+	}
+	if (p) ZSTR_LEN(ss->s) = p - ZSTR_VAL(ss->s);
+	return val;
+}
+
+static zval *nextHashItem(Context *ctx, Frame *f) {
+	zend_ulong idx;
+	zend_string *key;
+	zval *val;
+	while ((val = zend_hash_get_current_data_ex(f->ht, &f->pos))) {
+		int type = zend_hash_get_current_key_ex(f->ht, &key, &idx, &f->pos);
+		zend_hash_move_forward_ex(f->ht, &f->pos);
+		if (type == HASH_KEY_IS_STRING) {
+			if (!ZSTR_LEN(key)) continue; /* Empty key can't be represented in AMF3 */
+			if (f->obj && !ZSTR_VAL(key)[0]) continue; /* Skip private/protected property */
+			encodeString(ctx->ss, key, &ctx->sht);
+		} else {
+			char buf[22];
+			encodeStringEx(ctx->ss, buf, sprintf(buf, "%ld", idx), 0, &ctx->sht);
+		}
+		return val;
+	}
+	smart_str_appendc(ctx->ss, 0x01);
+	return 0;
+}
+
+static int nextIter(Frame *f) {
+	zend_object_iterator *it = f->it;
+	if (f->next) {
+		++it->index;
+		it->funcs->move_forward(it);
+		if (EG(exception)) return 0;
+	}
+	f->next = 1;
+	return it->funcs->valid(it) == SUCCESS && !EG(exception);
+}
+
+static zval *nextTraversableItem(Context *ctx, Frame *f) {
+	zend_object_iterator *it = f->it;
+	while (nextIter(f)) {
+		zval *item = it->funcs->get_current_data(it);
+		if (EG(exception)) return 0;
+		if (f->assoc) {
+			zval key;
+			int skip;
+			if (it->funcs->get_current_key) it->funcs->get_current_key(it, &key);
+			else ZVAL_LONG(&key, it->index);
+			if (EG(exception)) {
+				zval_ptr_dtor(&key);
+				return 0;
+			}
+			skip = !encodeKey(ctx->ss, &key, &ctx->sht);
+			zval_ptr_dtor(&key);
+			if (skip) continue;
+		} else if (++f->n == AMF3_INT_MAX) {
+			zend_throw_exception_ex(zend_ce_exception, 0, "Traversable is too long");
+			return 0;
+		}
+		return item;
+	}
+	if (EG(exception)) return 0;
+	if (f->assoc) smart_str_appendc(ctx->ss, 0x01);
+	else if (f->len == -1) insertU29(ctx->ss, f->ofs - ctx->base, (f->n << 1) | 1);
+	else if (f->n != f->len) zend_throw_exception_ex(zend_ce_exception, 0, "Traversable yielded %d values, expected %d", f->n, f->len);
+	return 0;
+}
+
+static zval *nextDictionaryItem(Context *ctx, Frame *f) {
+	zend_object_iterator *it = f->it;
+	if (f->half) { /* Value follows key */
+		f->half = 0;
+		return &f->item;
+	}
+	while (nextIter(f)) {
+		zval *data = it->funcs->get_current_data(it);
+		if (EG(exception)) return 0;
+		zval_ptr_dtor(&f->key);
+		zval_ptr_dtor(&f->item);
+		ZVAL_UNDEF(&f->key);
+		ZVAL_UNDEF(&f->item);
+		if (Z_OBJCE(f->val) == amf3_weakmap_ce) { /* WeakMap yields objects as keys */
+			it->funcs->get_current_key(it, &f->key);
+			ZVAL_COPY(&f->item, data);
+		} else { /* SplObjectStorage yields objects as values and keeps data aside */
+			ZVAL_COPY(&f->key, data);
+			callMethod(&f->val, "getInfo", &f->item);
+		}
+		if (EG(exception)) return 0;
+		if (++f->n > f->len) continue;
+		f->half = 1;
+		return &f->key;
+	}
+	if (!EG(exception) && f->n != f->len) zend_throw_exception_ex(zend_ce_exception, 0, "Dictionary yielded %d entries, expected %d", f->n, f->len);
+	return 0;
+}
+
+static void encodeValue(Context *ctx, zval *val);
+
+static void encodeValueData(Context *ctx, zval *val) {
+	smart_str *ss = ctx->ss;
 	switch (Z_TYPE_P(val)) {
 		default:
 			smart_str_appendc(ss, AMF3_UNDEFINED);
@@ -187,31 +493,46 @@ static void encodeValueData(smart_str *ss, zval *val, int opts, HashTable *sht,
 			break;
 		case IS_STRING:
 			smart_str_appendc(ss, AMF3_STRING);
-			encodeString(ss, Z_STRVAL_P(val), Z_STRLEN_P(val), sht);
+			encodeString(ss, Z_STR_P(val), &ctx->sht);
 			break;
 		case IS_ARRAY: {
 			int len = getArrayLength(val);
-			if (!(opts & AMF3_FORCE_OBJECT) || len != -1) {
+			if (!(ctx->opts & AMF3_FORCE_OBJECT) || len != -1) {
 				smart_str_appendc(ss, AMF3_ARRAY);
-				encodeArray(ss, val, opts, sht, oht, tht, lvl, len);
+				encodeArray(ctx, val, len);
 				break;
 			}
 		} /* Fall through; encode array as object */
 		case IS_OBJECT:
+			if (Z_TYPE_P(val) == IS_OBJECT) {
+				zend_class_entry *ce = Z_OBJCE_P(val);
+				if (isDictionary(ce)) {
+					encodeDictionary(ctx, val);
+					break;
+				}
+				if ((ctx->opts & (AMF3_TRAVERSABLE | AMF3_TRAVERSABLE_ASSOC)) && instanceof_function(ce, zend_ce_traversable)) {
+					encodeTraversable(ctx, val);
+					break;
+				}
+			}
 			smart_str_appendc(ss, AMF3_OBJECT);
-			encodeObject(ss, val, opts, sht, oht, tht, lvl);
+			encodeObject(ctx, val);
 			break;
 		case IS_REFERENCE:
-			encodeValue(ss, Z_REFVAL_P(val), opts, sht, oht, tht, lvl);
+			encodeValue(ctx, Z_REFVAL_P(val));
 			break;
 	}
 }
 
-static void encodeValue(smart_str *ss, zval *val, int opts, HashTable *sht, HashTable *oht, HashTable *tht, int lvl) {
+static void encodeValue(Context *ctx, zval *val) {
 	zval func, res;
-	if (lvl > MAXDEPTH) zend_error_noreturn(E_ERROR, "Recursion detected");
+	if (ctx->max && ctx->top >= ctx->max) {
+		php_error(E_WARNING, "Depth limit exceeded");
+		ctx->err = 1;
+		return;
+	}
 	if (Z_TYPE_P(val) != IS_OBJECT || !instanceof_function(Z_OBJCE_P(val), amf3_serializable_ce)) {
-		encodeValueData(ss, val, opts, sht, oht, tht, lvl);
+		encodeValueData(ctx, val);
 		return;
 	}
 	ZVAL_STRING(&func, "__toAMF3");
@@ -221,31 +542,523 @@ static void encodeValue(smart_str *ss, zval *val, int opts, HashTable *sht, Hash
 		zval_ptr_dtor(&res);
 		return;
 	}
-	encodeValueData(ss, &res, opts, sht, oht, tht, lvl);
+	ctx->tmp = 1; /* Result is freed right after encoding */
+	encodeValueData(ctx, &res);
 	zval_ptr_dtor(&res);
 }
 
+static void compressOutput(Context *ctx, size_t end) { /* Compress output before 'end' and drop it */
+	smart_str *ss = ctx->ss;
+	if (end) {
+		if (!amf3_deflate(ctx->zd, ctx->out, ZSTR_VAL(ss->s), end, 0)) {
+			ctx->err = 1;
+			return;
+		}
+		memmove(ZSTR_VAL(ss->s), ZSTR_VAL(ss->s) + end, ZSTR_LEN(ss->s) - end);
+		ZSTR_LEN(ss->s) -= end;
+		ctx->base += end;
+	}
+	ctx->mark = ZSTR_LEN(ss->s) + ZCHUNK; /* Don't retry until more output is collected */
+}
+
+static size_t getFinal(Context *ctx) { /* Length of output that won't be patched anymore */
+	int i;
+	for (i = 0; i < ctx->top; ++i) {
+		Frame *f = ctx->stk + i;
+		if (f->type == FRAME_TRAVERSABLE && !f->assoc && f->len == -1) return f->ofs - ctx->base;
+	}
+	return ZSTR_LEN(ctx->ss->s);
+}
+
+static void encodeTree(Context *ctx, zval *val) {
+	encodeValue(ctx, val);
+	while (ctx->top && !ctx->err && !EG(exception)) {
+		Frame *f;
+		zval *item;
+		if (ctx->zd && ZSTR_LEN(ctx->ss->s) >= ctx->mark) {
+			compressOutput(ctx, getFinal(ctx));
+			continue;
+		}
+		if (ctx->top == ctx->cap) growStack(ctx); /* Keep the frame in place while its item is pushed */
+		f = ctx->stk + ctx->top - 1;
+		switch (f->type) {
+			case FRAME_ARRAY:
+				item = nextArrayItem(ctx, f);
+				break;
+			case FRAME_HASH:
+				item = nextHashItem(ctx, f);
+				break;
+			case FRAME_TRAVERSABLE:
+				item = nextTraversableItem(ctx, f);
+				break;
+			default:
+				item = nextDictionaryItem(ctx, f);
+				break;
+		}
+		if (!item) {
+			popFrame(ctx);
+			continue;
+		}
+		ctx->tmp = f->tmp || f->type == FRAME_TRAVERSABLE; /* Iterator may free its items as it moves on */
+		encodeValue(ctx, item);
+	}
+	while (ctx->top) popFrame(ctx); /* Unwind on error */
+	if (ctx->stk) efree(ctx->stk);
+}
+
+typedef struct {
+	int obj; /* JSON object */
+	int n; /* Number of array elements */
+	size_t ofs; /* Where to insert the array length */
+} JsonFrame;
+
+static const char *skipSpace(const char *p, const char *e) {
+	while (p < e && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) ++p;
+	return p;
+}
+
+static int getHex(const char *p, const char *e) {
+	int i, x = 0;
+	if (e - p < 4) return -1;
+	for (i = 0; i < 4; ++i) {
+		int c = p[i];
+		if (c >= '0' && c <= '9') c -= '0';
+		else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') c = (c | 0x20) - 'a' + 10;
+		else return -1;
+		x = x << 4 | c;
+	}
+	return x;
+}
+
+static void appendUtf8(smart_str *ss, int cp) {
+	char buf[4];
+	int len;
+	if (cp < 0x80) {
+		buf[0] = cp;
+		len = 1;
+	} else if (cp < 0x800) {
+		buf[0] = 0xc0 | (cp >> 6);
+		buf[1] = 0x80 | (cp & 0x3f);
+		len = 2;
+	} else if (cp < 0x10000) {
+		buf[0] = 0xe0 | (cp >> 12);
+		buf[1] = 0x80 | ((cp >> 6) & 0x3f);
+		buf[2] = 0x80 | (cp & 0x3f);
+		len = 3;
+	} else {
+		buf[0] = 0xf0 | (cp >> 18);
+		buf[1] = 0x80 | ((cp >> 12) & 0x3f);
+		buf[2] = 0x80 | ((cp >> 6) & 0x3f);
+		buf[3] = 0x80 | (cp & 0x3f);
+		len = 4;
+	}
+	smart_str_appendl(ss, buf, len);
+}
+
+static const char *parseString(const char *p, const char *e, const char *s, smart_str *tmp, const char **str, size_t *len) {
+	const char *q = ++p; /* Skip opening quote */
+	while (q < e && *q != '"' && *q != '\\' && (unsigned char)*q >= 0x20) ++q;
+	if (q < e && *q == '"') { /* No escape sequences */
+		*str = p;
+		*len = q - p;
+		return q + 1;
+	}
+	if (tmp->s) ZSTR_LEN(tmp->s) = 0;
+	for (;;) {
+		smart_str_appendl(tmp, p, q - p);
+		if (q == e) {
+			php_error(E_WARNING, "Unterminated string at position %zu", (size_t)(e - s));
+			return 0;
+		}
+		if (*q == '"') break;
+		if (*q != '\\' || ++q == e) {
+			php_error(E_WARNING, "Invalid character at position %zu", (size_t)(q - s));
+			return 0;
+		}
+		switch (*q++) {
+			case '"':
+			case '\\':
+			case '/':
+				smart_str_appendc(tmp, q[-1]);
+				break;
+			case 'b':
+				smart_str_appendc(tmp, '\b');
+				break;
+			case 'f':
+				smart_str_appendc(tmp, '\f');
+				break;
+			case 'n':
+				smart_str_appendc(tmp, '\n');
+				break;
+			case 'r':
+				smart_str_appendc(tmp, '\r');
+				break;
+			case 't':
+				smart_str_appendc(tmp, '\t');
+				break;
+			case 'u': {
+				int cp = getHex(q, e), lo;
+				if (cp < 0) goto error;
+				q += 4;
+				if (cp >= 0xdc00 && cp <= 0xdfff) goto error; /* Unpaired low surrogate */
+				if (cp >= 0xd800 && cp <= 0xdbff) { /* Surrogate pair */
+					if (e - q < 6 || q[0] != '\\' || q[1] != 'u' || (lo = getHex(q + 2, e)) < 0xdc00 || lo > 0xdfff) goto error;
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+					q += 6;
+				}
+				appendUtf8(tmp, cp);
+				break;
+			}
+			default:
+			error:
+				php_error(E_WARNING, "Invalid escape sequence at position %zu", (size_t)(q - s - 1));
+				return 0;
+		}
+		for (p = q; q < e && *q != '"' && *q != '\\' && (unsigned char)*q >= 0x20; ++q);
+	}
+	smart_str_0(tmp);
+	*str = ZSTR_VAL(tmp->s);
+	*len = ZSTR_LEN(tmp->s);
+	return q + 1;
+}
+
+static const char *parseNumber(Context *ctx, const char *p, const char *e, const char *s) {
+	const char *q = p, *d;
+	zend_ulong x = 0;
+	int neg = *q == '-', dbl = 0;
+	if (neg) ++q;
+	d = q;
+	if (q < e && *q == '0') ++q;
+	else while (q < e && *q >= '0' && *q <= '9') {
+		if (x > (ZEND_ULONG_MAX - 9) / 10) dbl = 1; /* Too large for an integer */
+		x = x * 10 + (*q++ - '0');
+	}
+	if (q == d) goto error;
+	if (q < e && *q == '.') {
+		d = ++q;
+		while (q < e && *q >= '0' && *q <= '9') ++q;
+		if (q == d) goto error;
+		dbl = 1;
+	}
+	if (q < e && (*q | 0x20) == 'e') {
+		if (++q < e && (*q == '+' || *q == '-')) ++q;
+		d = q;
+		while (q < e && *q >= '0' && *q <= '9') ++q;
+		if (q == d) goto error;
+		dbl = 1;
+	}
+	if (!dbl && x <= (zend_ulong)AMF3_INT_MAX + neg) {
+		smart_str_appendc(ctx->ss, AMF3_INTEGER);
+		encodeU29(ctx->ss, neg ? -(int)x : (int)x);
+	} else {
+		smart_str_appendc(ctx->ss, AMF3_DOUBLE);
+		encodeDouble(ctx->ss, zend_strtod(p, 0));
+	}
+	return q;
+error:
+	php_error(E_WARNING, "Invalid number at position %zu", (size_t)(p - s));
+	return 0;
+}
+
+static const char *parseLiteral(Context *ctx, const char *p, const char *e, const char *s) {
+	static const struct { const char *str; size_t len; int type; } lit[] = {
+		{"null", 4, AMF3_NULL},
+		{"false", 5, AMF3_FALSE},
+		{"true", 4, AMF3_TRUE},
+	};
+	size_t i;
+	for (i = 0; i < sizeof lit / sizeof *lit; ++i) {
+		if ((size_t)(e - p) >= lit[i].len && !memcmp(p, lit[i].str, lit[i].len)) {
+			smart_str_appendc(ctx->ss, lit[i].type);
+			return p + lit[i].len;
+		}
+	}
+	php_error(E_WARNING, "Invalid character at position %zu", (size_t)(p - s));
+	return 0;
+}
+
+static const char *parseKey(Context *ctx, const char *p, const char *e, const char *s, smart_str *tmp) {
+	const char *str;
+	size_t len;
+	p = skipSpace(p, e);
+	if (p == e || *p != '"') {
+		php_error(E_WARNING, "Expected key at position %zu", (size_t)(p - s));
+		return 0;
+	}
+	if (!(p = parseString(p, e, s, tmp, &str, &len))) return 0;
+	if (!len) { /* Empty key can't be represented in AMF3 */
+		php_error(E_WARNING, "Empty key at position %zu", (size_t)(p - s - 2));
+		return 0;
+	}
+	encodeStringEx(ctx->ss, str, len, 0, &ctx->sht);
+	p = skipSpace(p, e);
+	if (p == e || *p != ':') {
+		php_error(E_WARNING, "Expected ':' at position %zu", (size_t)(p - s));
+		return 0;
+	}
+	return p + 1;
+}
+
+static void jsonTree(Context *ctx, const char *s, size_t size) {
+	smart_str *ss = ctx->ss, tmp = {0};
+	const char *p = s, *e = s + size, *str;
+	JsonFrame *stk = 0, *f;
+	int top = 0, cap = 0;
+	size_t len;
+	for (;;) {
+		if (ctx->zd && ss->s && ZSTR_LEN(ss->s) >= ctx->mark) {
+			size_t end = ZSTR_LEN(ss->s);
+			int i;
+			for (i = 0; i < top; ++i) {
+				if (stk[i].obj) continue;
+				end = stk[i].ofs - ctx->base; /* Length of a dense array is still to be inserted */
+				break;
+			}
+			compressOutput(ctx, end);
+			if (ctx->err) goto error;
+		}
+		p = skipSpace(p, e); /* Value is expected */
+		if (p == e) {
+			php_error(E_WARNING, "Unexpected end of data at position %zu", size);
+			goto error;
+		}
+		if (ctx->max && top >= ctx->max) {
+			php_error(E_WARNING, "Depth limit exceeded at position %zu", (size_t)(p - s));
+			goto error;
+		}
+		switch (*p) {
+			case '{':
+			case '[':
+				if (top == cap) stk = erealloc(stk, (cap = cap ? cap << 1 : 16) * sizeof *stk);
+				f = stk + top++;
+				f->obj = *p == '{';
+				f->n = 0;
+				if (f->obj && (ctx->opts & AMF3_FORCE_OBJECT)) { /* Encode as anonymous object */
+					smart_str_appendc(ss, AMF3_OBJECT);
+					encodeTraits(ss, zend_standard_class_def, &ctx->sht, &ctx->tht);
+				} else {
+					smart_str_appendc(ss, AMF3_ARRAY);
+					f->ofs = ctx->base + ZSTR_LEN(ss->s); /* Length of a dense array is inserted here afterwards */
+					smart_str_appendc(ss, 0x01);
+				}
+				p = skipSpace(p + 1, e);
+				if (p < e && *p == (f->obj ? '}' : ']')) break; /* Empty container */
+				if (f->obj && !(p = parseKey(ctx, p, e, s, &tmp))) goto error;
+				f->n = 1;
+				continue;
+			case '"':
+				if (!(p = parseString(p, e, s, &tmp, &str, &len))) goto error;
+				if (len > AMF3_INT_MAX) {
+					php_error(E_WARNING, "String is too long at position %zu", (size_t)(p - s));
+					goto error;
+				}
+				smart_str_appendc(ss, AMF3_STRING);
+				encodeStringEx(ss, str, len, 0, &ctx->sht);
+				p = skipSpace(p, e);
+				break;
+			case '-':
+			case '0': case '1': case '2': case '3': case '4':
+			case '5': case '6': case '7': case '8': case '9':
+				if (!(p = parseNumber(ctx, p, e, s))) goto error;
+				p = skipSpace(p, e);
+				break;
+			default:
+				if (!(p = parseLiteral(ctx, p, e, s))) goto error;
+				p = skipSpace(p, e);
+				break;
+		}
+		for (;;) { /* Value is complete */
+			if (!top) {
+				if (p != e) {
+					php_error(E_WARNING, "Trailing data at position %zu", (size_t)(p - s));
+					goto error;
+				}
+				goto done;
+			}
+			f = stk + top - 1;
+			if (p == e) {
+				php_error(E_WARNING, "Unexpected end of data at position %zu", size);
+				goto error;
+			}
+			if (*p == ',') {
+				++p;
+				if (f->obj && !(p = parseKey(ctx, p, e, s, &tmp))) goto error;
+				if (++f->n == AMF3_INT_MAX) {
+					php_error(E_WARNING, "Array is too long at position %zu", (size_t)(p - s));
+					goto error;
+				}
+				break;
+			}
+			if (*p != (f->obj ? '}' : ']')) {
+				php_error(E_WARNING, "Unexpected character at position %zu", (size_t)(p - s));
+				goto error;
+			}
+			if (f->obj) smart_str_appendc(ss, 0x01);
+			else insertU29(ss, f->ofs - ctx->base, (f->n << 1) | 1);
+			--top;
+			p = skipSpace(p + 1, e);
+		}
+	}
+error:
+	ctx->err = 1;
+done:
+	smart_str_free(&tmp);
+	if (stk) efree(stk);
+}
+
 static void freePtr(zval *val) {
 	efree(Z_PTR_P(val));
 }
 
+static void freeStrRef(zval *val) {
+	StrRef *ref = Z_PTR_P(val);
+	zend_string_release(ref->str);
+	efree(ref);
+}
+
+static int getLimit(zend_long x) {
+	return x < 0 ? 0 : x > AMF3_INT_MAX ? AMF3_INT_MAX : x;
+}
+
+static int getOptions(zval *val, Context *ctx) {
+	zend_string *key;
+	zval *item;
+	if (!val) return 1;
+	if (Z_TYPE_P(val) != IS_ARRAY) {
+		ctx->opts = zval_get_long(val);
+		return 1;
+	}
+	ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(val), key, item) {
+		if (!key) {
+			php_error(E_WARNING, "Invalid option");
+			return 0;
+		}
+		if (zend_string_equals_literal(key, "flags")) ctx->opts = zval_get_long(item);
+		else if (zend_string_equals_literal(key, "string_min_length")) ctx->sht.min = getLimit(zval_get_long(item));
+		else if (zend_string_equals_literal(key, "string_table_size")) ctx->sht.max = getLimit(zval_get_long(item));
+		else if (zend_string_equals_literal(key, "max_depth")) ctx->max = getLimit(zval_get_long(item));
+		else {
+			php_error(E_WARNING, "Unknown option '%s'", ZSTR_VAL(key));
+			return 0;
+		}
+	} ZEND_HASH_FOREACH_END();
+	return 1;
+}
+
+static int encode(smart_str *ss, zval *val, zval *zopts, int json) {
+	smart_str zs = {0};
+	Context ctx = {0};
+	int res;
+	ctx.max = getLimit(AMF3_G(encode_max_depth));
+	if (!getOptions(zopts, &ctx)) return 0;
+	if (!(ctx.opts & AMF3_COMPRESS)) ctx.ss = ss;
+	else { /* Output is compressed as it becomes final */
+		if (!(ctx.zd = amf3_deflate_init())) return 0;
+		ctx.ss = &zs;
+		ctx.out = ss;
+		ctx.mark = ZCHUNK;
+	}
+	ctx.sht.ident = ctx.opts & AMF3_STRING_IDENTITY;
+	zend_hash_init(&ctx.sht.ht, 0, 0, ctx.sht.ident ? freeStrRef : freePtr, 0);
+	zend_hash_init(&ctx.oht.ht, 0, 0, freePtr, 0);
+	zend_hash_init(&ctx.tht, 0, 0, freePtr, 0);
+	if (json) jsonTree(&ctx, Z_STRVAL_P(val), Z_STRLEN_P(val));
+	else encodeTree(&ctx, val);
+	AMF3_G(str_count) = ctx.sht.cnt + ctx.sht.refs;
+	AMF3_G(str_refs) = ctx.sht.refs;
+	AMF3_G(str_table) = zend_hash_num_elements(&ctx.sht.ht);
+	zend_hash_destroy(&ctx.sht.ht);
+	zend_hash_destroy(&ctx.oht.ht);
+	zend_hash_destroy(&ctx.tht);
+	res = !ctx.err && !EG(exception);
+	if (ctx.zd) {
+		if (res) res = amf3_deflate(ctx.zd, ss, zs.s ? ZSTR_VAL(zs.s) : "", zs.s ? ZSTR_LEN(zs.s) : 0, 1);
+		amf3_deflate_free(ctx.zd);
+	}
+	smart_str_free(&zs);
+	return res;
+}
+
 PHP_FUNCTION(amf3_encode) {
 	smart_str ss = {0};
-	zval *val;
-	zend_long opts = 0;
-	HashTable sht, oht, tht;
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z|l", &val, &opts) == FAILURE) return;
-	zend_hash_init(&sht, 0, 0, freePtr, 0);
-	zend_hash_init(&oht, 0, 0, freePtr, 0);
-	zend_hash_init(&tht, 0, 0, freePtr, 0);
-	encodeValue(&ss, val, opts, &sht, &oht, &tht, 0);
-	zend_hash_destroy(&sht);
-	zend_hash_destroy(&oht);
-	zend_hash_destroy(&tht);
-	if (EG(exception)) {
+	zval *val, *opts = 0;
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z|z", &val, &opts) == FAILURE) return;
+	if (!encode(&ss, val, opts, 0)) {
 		smart_str_free(&ss);
-		return;
+		RETURN_FALSE;
+	}
+	smart_str_0(&ss);
+	RETURN_STR(ss.s);
+}
+
+PHP_FUNCTION(json_to_amf3) {
+	smart_str ss = {0};
+	zval *opts = 0, val;
+	zend_string *str;
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S|z", &str, &opts) == FAILURE) return;
+	ZVAL_STR(&val, str);
+	if (!encode(&ss, &val, opts, 1)) {
+		smart_str_free(&ss);
+		RETURN_FALSE;
 	}
 	smart_str_0(&ss);
 	RETURN_STR(ss.s);
 }
+
+PHP_FUNCTION(amf3_encode_into) {
+	smart_str ss = {0};
+	zval *buf, *val, *opts = 0;
+	zend_long pfx = 0;
+	zend_string *str;
+	size_t ofs, len;
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z/z|zl", &buf, &val, &opts, &pfx) == FAILURE) return;
+	if (pfx != 0 && pfx != 1 && pfx != 2 && pfx != 4) {
+		php_error(E_WARNING, "Invalid length prefix size %ld", (long)pfx);
+		RETURN_FALSE;
+	}
+	convert_to_string(buf);
+	str = Z_STR_P(buf);
+	if (ZSTR_IS_INTERNED(str) || GC_REFCOUNT(str) > 1) { /* Shared string can't be appended in place */
+		ss.s = zend_string_init(ZSTR_VAL(str), ZSTR_LEN(str), 0);
+		zend_string_release(str);
+	} else {
+		ss.s = str;
+		zend_string_forget_hash_val(str);
+	}
+	ZVAL_EMPTY_STRING(buf); /* Detach the buffer while encoding */
+	ss.a = ofs = ZSTR_LEN(ss.s); /* Capacity is unknown, so the first append grows it */
+	if (pfx) { /* Reserve space for the length prefix */
+		smart_str_alloc(&ss, pfx, 0);
+		ZSTR_LEN(ss.s) += pfx;
+	}
+	if (!encode(&ss, val, opts, 0)) {
+		ZSTR_LEN(ss.s) = ofs;
+		RETVAL_FALSE;
+	} else {
+		len = ZSTR_LEN(ss.s) - ofs - pfx;
+		if (pfx && pfx < (zend_long)sizeof len && len >> (pfx << 3)) {
+			php_error(E_WARNING, "Length %zu doesn't fit in %d-byte prefix", len, (int)pfx);
+			ZSTR_LEN(ss.s) = ofs;
+			RETVAL_FALSE;
+		} else {
+			char *p = ZSTR_VAL(ss.s) + ofs;
+			size_t x = len;
+			int i;
+			for (i = pfx; i--; x >>= 8) p[i] = x & 0xff; /* Big-endian length prefix */
+			RETVAL_LONG(len + pfx);
+		}
+	}
+	smart_str_0(&ss);
+	zval_ptr_dtor(buf);
+	ZVAL_STR(buf, ss.s);
+}
+
+PHP_FUNCTION(amf3_encode_stats) {
+	zend_long cnt = AMF3_G(str_count), refs = AMF3_G(str_refs);
+	if (zend_parse_parameters_none() == FAILURE) return;
+	array_init(return_value);
+	add_assoc_long(return_value, "strings", cnt);
+	add_assoc_long(return_value, "string_refs", refs);
+	add_assoc_long(return_value, "string_table", AMF3_G(str_table));
+	add_assoc_double(return_value, "string_hit_ratio", cnt ? (double)refs / cnt : 0);
+}
@@ -0,0 +1,202 @@
+/*
+** Copyright (C) 2010-2018 Arseny Vakhrushev <arseny.vakhrushev@gmail.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php.h"
+#include "php_amf3.h"
+#include "zend_interfaces.h"
+#include "zend_smart_str.h"
+#include "amf3.h"
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+typedef struct {
+	const char *buf;
+	size_t size;
+	void *map; /* Memory-mapped file contents */
+	zend_string *str; /* File contents read into memory when mapping is not possible */
+	DecodeOptions opts;
+	zend_object std;
+} FileDecoder;
+
+typedef struct {
+	zend_object_iterator it;
+	size_t pos, key; /* Every iterator has its own cursor */
+	zval val;
+} FileIterator;
+
+zend_class_entry *amf3_file_decoder_ce;
+static zend_object_handlers handlers;
+
+static FileDecoder *getDecoder(zend_object *obj) {
+	return (FileDecoder *)((char *)obj - XtOffsetOf(FileDecoder, std));
+}
+
+static void fetchValue(FileIterator *fi) {
+	FileDecoder *dec = getDecoder(Z_OBJ(fi->it.data));
+	zval_ptr_dtor(&fi->val);
+	ZVAL_UNDEF(&fi->val);
+	if (fi->pos >= dec->size) return;
+	fi->key = fi->pos;
+	fi->pos = amf3_decode_data(dec->buf, fi->pos, dec->size, &fi->val, &dec->opts);
+	if (fi->pos) return;
+	ZVAL_UNDEF(&fi->val); /* Stop iteration on error */
+	fi->pos = dec->size;
+}
+
+static int openFile(FileDecoder *dec, const char *path) {
+	php_stream *stream = php_stream_open_wrapper((char *)path, "rb", REPORT_ERRORS, 0);
+#ifdef HAVE_MMAP
+	int fd;
+	struct stat st;
+#endif
+	if (!stream) return 0;
+	dec->buf = "";
+#ifdef HAVE_MMAP
+	if (php_stream_can_cast(stream, PHP_STREAM_AS_FD) == SUCCESS
+		&& php_stream_cast(stream, PHP_STREAM_AS_FD, (void **)&fd, 0) == SUCCESS
+		&& !fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		if (!st.st_size) {
+			php_stream_close(stream);
+			return 1;
+		}
+		dec->map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (dec->map != MAP_FAILED) { /* Mapping outlives the descriptor */
+#ifdef MADV_SEQUENTIAL
+			madvise(dec->map, st.st_size, MADV_SEQUENTIAL);
+#endif
+			dec->buf = dec->map;
+			dec->size = st.st_size;
+			php_stream_close(stream);
+			return 1;
+		}
+		dec->map = 0;
+	}
+#endif
+	if ((dec->str = php_stream_copy_to_mem(stream, PHP_STREAM_COPY_ALL, 0))) {
+		dec->buf = ZSTR_VAL(dec->str);
+		dec->size = ZSTR_LEN(dec->str);
+	}
+	php_stream_close(stream);
+	return 1;
+}
+
+static zend_object *createObject(zend_class_entry *ce) {
+	FileDecoder *dec = ecalloc(1, sizeof *dec + zend_object_properties_size(ce));
+	zend_object_std_init(&dec->std, ce);
+	object_properties_init(&dec->std, ce);
+	dec->std.handlers = &handlers;
+	return &dec->std;
+}
+
+static void freeObject(zend_object *obj) {
+	FileDecoder *dec = getDecoder(obj);
+#ifdef HAVE_MMAP
+	if (dec->map) munmap(dec->map, dec->size);
+#endif
+	if (dec->str) zend_string_release(dec->str);
+	zend_object_std_dtor(obj);
+}
+
+static void iterDtor(zend_object_iterator *it) {
+	zval_ptr_dtor(&((FileIterator *)it)->val);
+	zval_ptr_dtor(&it->data);
+}
+
+static int iterValid(zend_object_iterator *it) {
+	return Z_TYPE(((FileIterator *)it)->val) != IS_UNDEF ? SUCCESS : FAILURE;
+}
+
+static zval *iterCurrentData(zend_object_iterator *it) {
+	return &((FileIterator *)it)->val;
+}
+
+static void iterCurrentKey(zend_object_iterator *it, zval *key) {
+	ZVAL_LONG(key, ((FileIterator *)it)->key);
+}
+
+static void iterMoveForward(zend_object_iterator *it) {
+	fetchValue((FileIterator *)it);
+}
+
+static void iterRewind(zend_object_iterator *it) {
+	FileIterator *fi = (FileIterator *)it;
+	fi->pos = 0;
+	fetchValue(fi);
+}
+
+static const zend_object_iterator_funcs iterFuncs = {
+	.dtor = iterDtor,
+	.valid = iterValid,
+	.get_current_data = iterCurrentData,
+	.get_current_key = iterCurrentKey,
+	.move_forward = iterMoveForward,
+	.rewind = iterRewind,
+};
+
+static zend_object_iterator *getIterator(zend_class_entry *ce, zval *obj, int ref) {
+	FileIterator *fi;
+	if (ref) {
+		zend_throw_error(0, "An iterator cannot be used with foreach by reference");
+		return 0;
+	}
+	fi = emalloc(sizeof *fi);
+	zend_iterator_init(&fi->it);
+	ZVAL_COPY(&fi->it.data, obj);
+	fi->it.funcs = (zend_object_iterator_funcs *)&iterFuncs;
+	fi->pos = fi->key = 0;
+	ZVAL_UNDEF(&fi->val);
+	return &fi->it;
+}
+
+void amf3_file_decoder_init(void) {
+	zend_class_entry ce;
+	INIT_CLASS_ENTRY(ce, "AMF3FileDecoder", 0);
+	amf3_file_decoder_ce = zend_register_internal_class(&ce);
+	amf3_file_decoder_ce->ce_flags |= ZEND_ACC_FINAL;
+	amf3_file_decoder_ce->create_object = createObject;
+	amf3_file_decoder_ce->get_iterator = getIterator;
+	zend_class_implements(amf3_file_decoder_ce, 1, zend_ce_traversable);
+	memcpy(&handlers, zend_get_std_object_handlers(), sizeof handlers);
+	handlers.offset = XtOffsetOf(FileDecoder, std);
+	handlers.free_obj = freeObject;
+	handlers.clone_obj = 0;
+}
+
+PHP_FUNCTION(amf3_decode_file) {
+	char *path;
+	size_t len;
+	zval *opts = 0;
+	FileDecoder *dec;
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "p|z", &path, &len, &opts) == FAILURE) return;
+	object_init_ex(return_value, amf3_file_decoder_ce);
+	dec = getDecoder(Z_OBJ_P(return_value));
+	if (amf3_decode_options(opts, &dec->opts) && openFile(dec, path)) return;
+	zval_ptr_dtor(return_value);
+	RETURN_FALSE;
+}
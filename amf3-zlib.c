@@ -0,0 +1,144 @@
+/*
+** Copyright (C) 2010-2018 Arseny Vakhrushev <arseny.vakhrushev@gmail.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "php.h"
+#include "php_amf3.h"
+#include "zend_smart_str.h"
+#include "amf3.h"
+
+#ifdef HAVE_AMF3_ZLIB
+
+#include <zlib.h>
+
+#define CHUNK 65536 /* Output is produced in chunks of this size */
+#define MAXIN ((uInt)-1) /* Input is consumed in chunks of at most this size */
+
+static voidpf zalloc(voidpf opaque, uInt num, uInt size) {
+	return safe_emalloc(num, size, 0);
+}
+
+static void zfree(voidpf opaque, voidpf ptr) {
+	efree(ptr);
+}
+
+static void initStream(z_stream *zs) {
+	memset(zs, 0, sizeof *zs);
+	zs->zalloc = zalloc;
+	zs->zfree = zfree;
+}
+
+static void feedStream(z_stream *zs, const char **buf, size_t *len) {
+	uInt n;
+	if (zs->avail_in || !*len) return;
+	n = *len > MAXIN ? MAXIN : *len;
+	zs->next_in = (Bytef *)*buf;
+	zs->avail_in = n;
+	*buf += n;
+	*len -= n;
+}
+
+static void prepareOutput(z_stream *zs, smart_str *ss) {
+	smart_str_alloc(ss, CHUNK, 0);
+	zs->next_out = (Bytef *)ZSTR_VAL(ss->s) + ZSTR_LEN(ss->s);
+	zs->avail_out = CHUNK;
+}
+
+void *amf3_deflate_init(void) {
+	z_stream *zs = emalloc(sizeof *zs);
+	initStream(zs);
+	if (deflateInit(zs, Z_DEFAULT_COMPRESSION) == Z_OK) return zs;
+	efree(zs);
+	php_error(E_WARNING, "Unable to initialize compression");
+	return 0;
+}
+
+int amf3_deflate(void *zd, smart_str *ss, const char *buf, size_t len, int end) { /* Append compressed data to 'ss' */
+	z_stream *zs = zd;
+	int res;
+	if (!len && !end) return 1;
+	do {
+		feedStream(zs, &buf, &len);
+		prepareOutput(zs, ss);
+		res = deflate(zs, len || !end ? Z_NO_FLUSH : Z_FINISH);
+		ZSTR_LEN(ss->s) += CHUNK - zs->avail_out;
+	} while (res == Z_OK && (end || len || zs->avail_in || !zs->avail_out)); /* More data might be pending */
+	if (res == (end ? Z_STREAM_END : Z_OK)) return 1;
+	php_error(E_WARNING, "Compression failed: %s", zs->msg ? zs->msg : "unknown error");
+	return 0;
+}
+
+void amf3_deflate_free(void *zd) {
+	deflateEnd(zd);
+	efree(zd);
+}
+
+int amf3_inflate(smart_str *ss, const char *buf, size_t size, size_t *len, size_t max) {
+	z_stream zs;
+	size_t rem = size;
+	int res;
+	initStream(&zs);
+	if (inflateInit(&zs) != Z_OK) {
+		php_error(E_WARNING, "Unable to initialize decompression");
+		return 0;
+	}
+	do {
+		feedStream(&zs, &buf, &rem);
+		prepareOutput(&zs, ss);
+		res = inflate(&zs, Z_NO_FLUSH);
+		ZSTR_LEN(ss->s) += CHUNK - zs.avail_out;
+		if (max && ZSTR_LEN(ss->s) > max) res = Z_MEM_ERROR; /* Stop before a small input expands to gigabytes */
+	} while (res == Z_OK);
+	*len = size - rem - zs.avail_in;
+	inflateEnd(&zs);
+	if (res != Z_STREAM_END) {
+		if (res == Z_MEM_ERROR) php_error(E_WARNING, "Decompressed data limit exceeded at position %zu", *len);
+		else if (res == Z_BUF_ERROR) php_error(E_WARNING, "Insufficient compressed data at position %zu", *len);
+		else php_error(E_WARNING, "Decompression failed at position %zu: %s", *len, zs.msg ? zs.msg : "unknown error");
+		return 0;
+	}
+	return 1;
+}
+
+#else
+
+void *amf3_deflate_init(void) {
+	php_error(E_WARNING, "Compression is not supported");
+	return 0;
+}
+
+int amf3_deflate(void *zd, smart_str *ss, const char *buf, size_t len, int end) {
+	return 0;
+}
+
+void amf3_deflate_free(void *zd) {
+}
+
+int amf3_inflate(smart_str *ss, const char *buf, size_t size, size_t *len, size_t max) {
+	php_error(E_WARNING, "Compression is not supported");
+	return 0;
+}
+
+#endif
@@ -27,6 +27,7 @@
 #include "php.h"
 #include "php_amf3.h"
 #include "ext/standard/info.h"
+#include "zend_smart_str.h"
 #include "amf3.h"
 
 ZEND_BEGIN_ARG_INFO_EX(arginfo_amf3_encode, 0, 0, 1)
@@ -34,18 +35,49 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_amf3_encode, 0, 0, 1)
 	ZEND_ARG_INFO(0, options)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_amf3_encode_into, 0, 0, 2)
+	ZEND_ARG_INFO(1, buffer)
+	ZEND_ARG_INFO(0, value)
+	ZEND_ARG_INFO(0, options)
+	ZEND_ARG_INFO(0, prefix)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_amf3_encode_stats, 0)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_amf3_decode, 0, 0, 1)
 	ZEND_ARG_INFO(0, amf3)
 	ZEND_ARG_INFO(1, count)
 	ZEND_ARG_INFO(0, options)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_amf3_decode_file, 0, 0, 1)
+	ZEND_ARG_INFO(0, path)
+	ZEND_ARG_INFO(0, options)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_amf3_to_json, 0, 0, 1)
+	ZEND_ARG_INFO(0, amf3)
+	ZEND_ARG_INFO(1, count)
+	ZEND_ARG_INFO(0, options)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_json_to_amf3, 0, 0, 1)
+	ZEND_ARG_INFO(0, json)
+	ZEND_ARG_INFO(0, options)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO(arginfo_AMF3Serializable___toAMF3, 0)
 ZEND_END_ARG_INFO()
 
 static const zend_function_entry amf3_functions[] = {
 	PHP_FE(amf3_encode, arginfo_amf3_encode)
+	PHP_FE(amf3_encode_into, arginfo_amf3_encode_into)
+	PHP_FE(amf3_encode_stats, arginfo_amf3_encode_stats)
 	PHP_FE(amf3_decode, arginfo_amf3_decode)
+	PHP_FE(amf3_decode_file, arginfo_amf3_decode_file)
+	PHP_FE(amf3_to_json, arginfo_amf3_to_json)
+	PHP_FE(json_to_amf3, arginfo_json_to_amf3)
 	PHP_FE_END
 };
 
@@ -54,33 +86,83 @@ static const zend_function_entry class_AMF3Serializable_methods[] = {
 	PHP_FE_END
 };
 
+ZEND_DECLARE_MODULE_GLOBALS(amf3)
+
 zend_class_entry *amf3_serializable_ce;
+zend_class_entry *amf3_storage_ce;
+zend_class_entry *amf3_weakmap_ce;
+
+static const zend_module_dep amf3_deps[] = {
+	ZEND_MOD_REQUIRED("spl")
+	ZEND_MOD_END
+};
 
 zend_module_entry amf3_module_entry = {
-	STANDARD_MODULE_HEADER,
+	STANDARD_MODULE_HEADER_EX,
+	0,
+	amf3_deps,
 	"amf3",
 	amf3_functions,
 	PHP_MINIT(amf3),
-	0,
+	PHP_MSHUTDOWN(amf3),
 	0,
 	0,
 	PHP_MINFO(amf3),
 	PHP_AMF3_VERSION,
-	STANDARD_MODULE_PROPERTIES
+	PHP_MODULE_GLOBALS(amf3),
+	PHP_GINIT(amf3),
+	0,
+	0,
+	STANDARD_MODULE_PROPERTIES_EX
 };
 
 #ifdef COMPILE_DL_AMF3
+#ifdef ZTS
+ZEND_TSRMLS_CACHE_DEFINE()
+#endif
 ZEND_GET_MODULE(amf3)
 #endif
 
+PHP_INI_BEGIN()
+	STD_PHP_INI_ENTRY("amf3.encode_max_depth", "512", PHP_INI_ALL, OnUpdateLong, encode_max_depth, zend_amf3_globals, amf3_globals)
+	STD_PHP_INI_ENTRY("amf3.decode_max_depth", "512", PHP_INI_ALL, OnUpdateLong, decode_max_depth, zend_amf3_globals, amf3_globals)
+	STD_PHP_INI_ENTRY("amf3.decode_max_elements", "0", PHP_INI_ALL, OnUpdateLong, decode_max_elements, zend_amf3_globals, amf3_globals)
+	STD_PHP_INI_ENTRY("amf3.decode_max_bytes", "0", PHP_INI_ALL, OnUpdateLong, decode_max_bytes, zend_amf3_globals, amf3_globals)
+	STD_PHP_INI_ENTRY("amf3.decode_max_refs", "0", PHP_INI_ALL, OnUpdateLong, decode_max_refs, zend_amf3_globals, amf3_globals)
+	STD_PHP_INI_ENTRY("amf3.decode_max_inflated", "67108864", PHP_INI_ALL, OnUpdateLong, decode_max_inflated, zend_amf3_globals, amf3_globals)
+PHP_INI_END()
+
+PHP_GINIT_FUNCTION(amf3) {
+#if defined(COMPILE_DL_AMF3) && defined(ZTS)
+	ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+	memset(amf3_globals, 0, sizeof *amf3_globals);
+}
+
 PHP_MINIT_FUNCTION(amf3) {
 	zend_class_entry ce;
+	REGISTER_INI_ENTRIES();
 	INIT_CLASS_ENTRY(ce, "AMF3Serializable", class_AMF3Serializable_methods);
 	amf3_serializable_ce = zend_register_internal_interface(&ce);
+	amf3_file_decoder_init();
+	amf3_storage_ce = zend_hash_str_find_ptr(CG(class_table), "splobjectstorage", sizeof "splobjectstorage" - 1);
+	amf3_weakmap_ce = zend_hash_str_find_ptr(CG(class_table), "weakmap", sizeof "weakmap" - 1);
 	REGISTER_LONG_CONSTANT("AMF3_FORCE_OBJECT", AMF3_FORCE_OBJECT, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("AMF3_TRAVERSABLE", AMF3_TRAVERSABLE, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("AMF3_TRAVERSABLE_ASSOC", AMF3_TRAVERSABLE_ASSOC, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("AMF3_COMPRESS", AMF3_COMPRESS, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("AMF3_STRING_IDENTITY", AMF3_STRING_IDENTITY, CONST_CS | CONST_PERSISTENT);
 	REGISTER_LONG_CONSTANT("AMF3_CLASS_MAP", AMF3_CLASS_MAP, CONST_CS | CONST_PERSISTENT);
 	REGISTER_LONG_CONSTANT("AMF3_CLASS_AUTOLOAD", AMF3_CLASS_AUTOLOAD, CONST_CS | CONST_PERSISTENT);
 	REGISTER_LONG_CONSTANT("AMF3_CLASS_CONSTRUCT", AMF3_CLASS_CONSTRUCT, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("AMF3_DECOMPRESS", AMF3_DECOMPRESS, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("AMF3_UTF8_VALIDATE", AMF3_UTF8_VALIDATE, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("AMF3_UTF8_REPLACE", AMF3_UTF8_REPLACE, CONST_CS | CONST_PERSISTENT);
+	return SUCCESS;
+}
+
+PHP_MSHUTDOWN_FUNCTION(amf3) {
+	UNREGISTER_INI_ENTRIES();
 	return SUCCESS;
 }
 
@@ -88,5 +170,11 @@ PHP_MINFO_FUNCTION(amf3) {
 	php_info_print_table_start();
 	php_info_print_table_row(2, "AMF3 support", "enabled");
 	php_info_print_table_row(2, "Version", PHP_AMF3_VERSION);
+#ifdef HAVE_AMF3_ZLIB
+	php_info_print_table_row(2, "Compression support", "enabled");
+#else
+	php_info_print_table_row(2, "Compression support", "disabled");
+#endif
 	php_info_print_table_end();
+	DISPLAY_INI_ENTRIES();
 }
@@ -45,11 +45,34 @@
 #define AMF3_INT_MAX 268435455
 
 /* Encoding options */
-#define AMF3_FORCE_OBJECT 0x01
+#define AMF3_FORCE_OBJECT       0x01
+#define AMF3_TRAVERSABLE        0x02
+#define AMF3_TRAVERSABLE_ASSOC  0x04
+#define AMF3_COMPRESS           0x08
+#define AMF3_STRING_IDENTITY    0x10
 
 /* Decoding options */
 #define AMF3_CLASS_MAP       0x01
 #define AMF3_CLASS_AUTOLOAD  0x02
 #define AMF3_CLASS_CONSTRUCT 0x04
+#define AMF3_DECOMPRESS      0x08
+#define AMF3_UTF8_VALIDATE   0x10
+#define AMF3_UTF8_REPLACE    0x20
 
 extern zend_class_entry *amf3_serializable_ce;
+extern zend_class_entry *amf3_file_decoder_ce;
+extern zend_class_entry *amf3_storage_ce; /* SplObjectStorage */
+extern zend_class_entry *amf3_weakmap_ce; /* WeakMap (PHP 8.0+) */
+
+typedef struct {
+	int flags;
+	zend_long max_depth, max_elements, max_bytes, max_refs, max_inflated; /* Zero means no limit */
+} DecodeOptions;
+
+void amf3_file_decoder_init(void);
+int amf3_decode_options(zval *val, DecodeOptions *o);
+size_t amf3_decode_data(const char *buf, size_t pos, size_t size, zval *val, const DecodeOptions *o);
+void *amf3_deflate_init(void);
+int amf3_deflate(void *zd, smart_str *ss, const char *buf, size_t len, int end);
+void amf3_deflate_free(void *zd);
+int amf3_inflate(smart_str *ss, const char *buf, size_t size, size_t *len, size_t max);
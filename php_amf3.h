@@ -33,11 +33,31 @@ extern zend_module_entry amf3_module_entry;
 #include "TSRM.h"
 #endif
 
+ZEND_BEGIN_MODULE_GLOBALS(amf3)
+	zend_long str_count, str_refs, str_table; /* String reference statistics of the last encoding */
+	zend_long encode_max_depth;
+	zend_long decode_max_depth, decode_max_elements, decode_max_bytes, decode_max_refs, decode_max_inflated;
+ZEND_END_MODULE_GLOBALS(amf3)
+
+ZEND_EXTERN_MODULE_GLOBALS(amf3)
+#define AMF3_G(v) ZEND_MODULE_GLOBALS_ACCESSOR(amf3, v)
+
+#if defined(ZTS) && defined(COMPILE_DL_AMF3)
+ZEND_TSRMLS_CACHE_EXTERN()
+#endif
+
+PHP_GINIT_FUNCTION(amf3);
 PHP_MINIT_FUNCTION(amf3);
+PHP_MSHUTDOWN_FUNCTION(amf3);
 PHP_MINFO_FUNCTION(amf3);
 
 PHP_FUNCTION(amf3_encode);
+PHP_FUNCTION(amf3_encode_into);
+PHP_FUNCTION(amf3_encode_stats);
 PHP_FUNCTION(amf3_decode);
+PHP_FUNCTION(amf3_decode_file);
+PHP_FUNCTION(amf3_to_json);
+PHP_FUNCTION(json_to_amf3);
 
 
 #endif
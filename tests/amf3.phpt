@@ -191,6 +191,279 @@ for ($i = 0; $i < count($strs); ++$i) {
 	if ($pos != strlen($str) || $obj != $obj_) die("Compliance test failed!\n");
 }
 
+//-----------------------//
+// String reference test //
+//-----------------------//
+
+$abc = strrev('CBA');
+$val = array('A', 'A', $abc, $abc, strrev('CBA'), 'DEF', 'DEF'); // Two distinct 'ABC' strings
+$opts = array(
+	array(0, 4),
+	array(array('string_min_length' => 2), 3),
+	array(array('string_table_size' => 2), 3),
+	array(array('flags' => AMF3_STRING_IDENTITY), 3),
+);
+foreach ($opts as $o) {
+	$str = amf3_encode($val, $o[0]);
+	$stats = amf3_encode_stats();
+	if (amf3_decode($str) !== $val || $stats['strings'] != 7 || $stats['string_refs'] != $o[1]) die("String reference test failed!\n");
+}
+
+//--------------------//
+// Integer array test //
+//--------------------//
+
+$val = range(-300000, 300000, 997);
+$val[] = 'ABC';
+$val = array_merge($val, $val, array(-268435456, 268435455));
+$str = amf3_encode($val);
+$pos = 0;
+if (amf3_decode($str, $pos) !== $val || $pos != strlen($str)) die("Integer array test failed!\n");
+for ($val = array(), $i = 0; $i < 70; ++$i) { // Short arrays at the end of the buffer
+	$val[] = $i % 2 ? $i : -$i * 9999;
+	$str = amf3_encode($val);
+	$pos = 0;
+	if (amf3_decode($str, $pos) !== $val || $pos != strlen($str)) die("Integer array test failed!\n");
+	$pos = 0;
+	if (@amf3_decode(substr($str, 0, -1), $pos) !== null || $pos != -1) die("Integer array test failed!\n");
+}
+
+//------------------//
+// Traversable test //
+//------------------//
+
+function gen() {
+	yield 'A' => 1;
+	yield 'B' => 'ABC';
+	yield 5 => [false, 'ABC'];
+}
+
+$tr = array(
+	array(gen(), AMF3_TRAVERSABLE, array(1, 'ABC', array(false, 'ABC'))),
+	array(gen(), AMF3_TRAVERSABLE_ASSOC, array('A' => 1, 'B' => 'ABC', 5 => array(false, 'ABC'))),
+	array(gen(), AMF3_TRAVERSABLE_ASSOC | AMF3_FORCE_OBJECT, (object)array('A' => 1, 'B' => 'ABC', 5 => array(false, 'ABC'))),
+	array(new ArrayIterator(array(1, 2, 3)), AMF3_TRAVERSABLE, array(1, 2, 3)),
+);
+
+foreach ($tr as $t) {
+	if (amf3_encode($t[0], $t[1]) !== amf3_encode($t[2], $t[1])) die("Traversable test failed!\n");
+}
+
+function rows() { // Each row is freed once the generator moves on
+	for ($i = 0; $i < 100; ++$i) yield array('id' => $i, 'name' => str_repeat('A', $i % 3));
+}
+
+$res = array();
+for ($i = 0; $i < 100; ++$i) $res[] = array('id' => $i, 'name' => str_repeat('A', $i % 3));
+if (amf3_decode(amf3_encode(rows(), AMF3_TRAVERSABLE)) !== $res) die("Traversable test failed!\n");
+
+class Row implements AMF3Serializable { // Each result is freed once encoded
+	public $id;
+	public function __construct($id) { $this->id = $id; }
+	public function __toAMF3() { return array('id' => $this->id, 'name' => str_repeat('A', $this->id % 3)); }
+}
+
+$val = array();
+for ($i = 0; $i < 100; ++$i) $val[] = new Row($i);
+if (amf3_decode(amf3_encode($val)) !== $res) die("Traversable test failed!\n");
+
+//-----------------------//
+// amf3_encode_into test //
+//-----------------------//
+
+$str = amf3_encode(array(1, 'ABC'));
+$buf = 'ABC';
+if (amf3_encode_into($buf, array(1, 'ABC')) !== strlen($str) || $buf !== 'ABC' . $str) die("amf3_encode_into test failed!\n");
+if (amf3_encode_into($buf, array(1, 'ABC'), 0, 2) !== strlen($str) + 2 || $buf !== 'ABC' . $str . pack('n', strlen($str)) . $str) die("amf3_encode_into test failed!\n");
+if (@amf3_encode_into($buf, str_repeat('A', 256), 0, 1) !== false || $buf !== 'ABC' . $str . pack('n', strlen($str)) . $str) die("amf3_encode_into test failed!\n");
+
+//-----------------------//
+// amf3_decode_file test //
+//-----------------------//
+
+$vals = array(array(1, 'ABC'), 'ABC', (object)array('A' => 0.5));
+$str = '';
+$res = array();
+foreach ($vals as $val) {
+	$res[strlen($str)] = $val;
+	$str .= amf3_encode($val);
+}
+$file = tempnam(sys_get_temp_dir(), 'amf3');
+file_put_contents($file, $str);
+if (iterator_to_array(amf3_decode_file($file, AMF3_CLASS_MAP)) != $res) die("amf3_decode_file test failed!\n");
+$dec = amf3_decode_file($file, AMF3_CLASS_MAP);
+$pairs = array();
+foreach ($dec as $key1 => $val1) { // Nested loops have separate cursors
+	foreach ($dec as $key2 => $val2) $pairs[] = array($key1, $key2);
+	if ($val1 != $res[$key1]) die("amf3_decode_file test failed!\n");
+}
+$keys = array_keys($res);
+$pairs2 = array();
+foreach ($keys as $key1) foreach ($keys as $key2) $pairs2[] = array($key1, $key2);
+if ($pairs !== $pairs2) die("amf3_decode_file test failed!\n");
+unlink($file);
+
+//-----------------//
+// Dictionary test //
+//-----------------//
+
+$str = "\x11\x05\x00" // Dictionary (length 2)
+	.	"\x06\x03\x41\x04\x01" // 'A' => 1
+	.	"\x04\x02\x02"; // 2 => false
+$pos = 0;
+if (amf3_decode($str, $pos) !== array('A' => 1, 2 => false) || $pos != strlen($str)) die("Dictionary test failed!\n");
+
+$o1 = new AAA();
+$o1->A = 1;
+$o2 = new BBB();
+$val = new SplObjectStorage();
+$val[$o1] = 'ABC';
+$val[$o2] = array($o1, $val);
+$pos = 0;
+$res = amf3_decode(amf3_encode($val), $pos, AMF3_CLASS_MAP);
+if (!$res instanceof SplObjectStorage || count($res) != 2) die("Dictionary test failed!\n");
+$keys = array();
+foreach ($res as $key) $keys[] = $key;
+$item = $res[$keys[1]];
+if ($keys[0] != $o1 || $keys[1] != $o2 || $res[$keys[0]] !== 'ABC' || $item[0] !== $keys[0] || $item[1] !== $res) die("Dictionary test failed!\n");
+
+$str = "\x11\x03\x01" // Dictionary (length 1, weak keys)
+	.	"\x0a\x0b\x01\x03\x41\x04\x01\x01" // Anonymous object {A: 1}
+	.	"\x06\x07\x41\x42\x43"; // 'ABC'
+$pos = 0;
+$res = amf3_decode($str, $pos, AMF3_CLASS_MAP);
+if (!$res instanceof SplObjectStorage || count($res) != 1 || $pos != strlen($str)) die("Dictionary test failed!\n");
+foreach ($res as $key) if ($key != (object)array('A' => 1) || $res[$key] !== 'ABC') die("Dictionary test failed!\n");
+
+//------------------//
+// Compression test //
+//------------------//
+
+function manyRows() {
+	for ($i = 0; $i < 20000; ++$i) yield array('id' => $i, 'name' => "row$i");
+}
+
+$val = array_fill(0, 100, array('A' => 'ABC', 'B' => 'DEF'));
+$str = @amf3_encode($val, AMF3_COMPRESS);
+if ($str !== false) { // Compression is supported
+	if (function_exists('gzuncompress') && gzuncompress($str) !== amf3_encode($val)) die("Compression test failed!\n");
+	$str = 'ABC' . $str . 'DEF';
+	$pos = 3;
+	if (amf3_decode($str, $pos, AMF3_DECOMPRESS) !== $val || $pos != strlen($str) - 3) die("Compression test failed!\n");
+	$val = str_repeat('A', 300000);
+	$str = amf3_encode($val, AMF3_COMPRESS);
+	$pos = 0;
+	if (@amf3_decode($str, $pos, array('flags' => AMF3_DECOMPRESS, 'max_inflated' => 100000)) !== null || $pos != -1) die("Compression test failed!\n");
+	$pos = 0;
+	if (amf3_decode($str, $pos, array('flags' => AMF3_DECOMPRESS, 'max_inflated' => 0)) !== $val || $pos != strlen($str)) die("Compression test failed!\n");
+	$res = iterator_to_array(manyRows());
+	$str = amf3_encode(array(1, manyRows(), 'ABC'), AMF3_COMPRESS | AMF3_TRAVERSABLE); // Output is compressed as it becomes final
+	$pos = 0;
+	if (amf3_decode($str, $pos, AMF3_DECOMPRESS) !== array(1, $res, 'ABC')) die("Compression test failed!\n");
+	$str = json_to_amf3(json_encode(array('A' => $res, 'B' => $res)), AMF3_COMPRESS);
+	$pos = 0;
+	if (amf3_decode($str, $pos, AMF3_DECOMPRESS) !== array('A' => $res, 'B' => $res)) die("Compression test failed!\n");
+}
+
+//--------------------//
+// Nesting depth test //
+//--------------------//
+
+$val = 1;
+for ($i = 0; $i < 1000; ++$i) $val = array('A' => $val);
+if (@amf3_encode($val) !== false) die("Nesting depth test failed!\n");
+if (@amf3_encode($val, array('max_depth' => 1000)) !== false) die("Nesting depth test failed!\n");
+$str = amf3_encode($val, array('max_depth' => 1001));
+$pos = 0;
+if (amf3_decode($str, $pos, array('max_depth' => 0)) !== $val) die("Nesting depth test failed!\n");
+if (amf3_encode($val, array('max_depth' => 0)) !== $str) die("Nesting depth test failed!\n");
+$val = array(array(1)); // Integers in a dense array count as one more level
+if (@amf3_encode($val, array('max_depth' => 2)) !== false) die("Nesting depth test failed!\n");
+$str = amf3_encode($val, array('max_depth' => 3));
+$pos = 0;
+if (@amf3_decode($str, $pos, array('max_depth' => 2)) !== null) die("Nesting depth test failed!\n");
+$pos = 0;
+if (amf3_decode($str, $pos, array('max_depth' => 3)) !== $val) die("Nesting depth test failed!\n");
+
+//-----------------------//
+// JSON transcoding test //
+//-----------------------//
+
+$val = array(1, -2, 3.5, 'A"B\\C', true, false, null, array('A' => array(), 'B' => array(1 << 30, 'é')));
+$str = amf3_encode($val);
+$pos = 0;
+if (amf3_to_json($str, $pos) !== json_encode($val, JSON_UNESCAPED_UNICODE) || $pos != strlen($str)) die("JSON transcoding test failed!\n");
+if (json_to_amf3(json_encode($val)) !== $str) die("JSON transcoding test failed!\n");
+if (json_to_amf3(' {"A" : [ ] , "B" : {"C" : "\u00e9"}} ', AMF3_FORCE_OBJECT) !== amf3_encode(array('A' => array(), 'B' => array('C' => 'é')), AMF3_FORCE_OBJECT)) die("JSON transcoding test failed!\n");
+$o = new stdClass();
+$o->A = 1;
+$str = amf3_encode(array($o, $o));
+if (amf3_to_json($str) !== '[{"A":1},{"A":1}]') die("JSON transcoding test failed!\n");
+$str = "\x09\x03\x01\x09\x00"; // Array containing itself
+$pos = 0;
+if (@amf3_to_json($str, $pos) !== false || $pos != -1) die("JSON transcoding test failed!\n");
+for ($val = array(), $i = 0; $i < 40; ++$i) { // Every level doubles the output
+	$val = array($val, $val);
+	if ($i == 8 && amf3_to_json(amf3_encode($val)) !== json_encode($val)) die("JSON transcoding test failed!\n");
+}
+if (@amf3_to_json(amf3_encode($val)) !== false) die("JSON transcoding test failed!\n");
+foreach (array('', '[1,]', '{"A":1', '[1] 2', '"\\ud800"', '01', '{"":1}') as $json) {
+	if (@json_to_amf3($json) !== false) die("JSON transcoding test failed!\n");
+}
+
+//------------//
+// UTF-8 test //
+//------------//
+
+$val = array('Açaí' => "\u{20AC}\u{1F600}", 'A' => 'Açaí');
+$str = amf3_encode($val);
+$pos = 0;
+if (amf3_decode($str, $pos, AMF3_UTF8_VALIDATE) !== $val) die("UTF-8 test failed!\n");
+$str = amf3_encode(array("A\xffB", "\xe2\x82", "\xed\xa0\x80", "A\xffB"));
+$pos = 0;
+if (@amf3_decode($str, $pos, AMF3_UTF8_VALIDATE) !== null || $pos != -1) die("UTF-8 test failed!\n");
+$pos = 0;
+if (amf3_decode($str, $pos, AMF3_UTF8_REPLACE) !== array("A\u{FFFD}B", "\u{FFFD}", "\u{FFFD}\u{FFFD}\u{FFFD}", "A\u{FFFD}B")) die("UTF-8 test failed!\n");
+if (amf3_decode($str) !== array("A\xffB", "\xe2\x82", "\xed\xa0\x80", "A\xffB")) die("UTF-8 test failed!\n");
+$pos = 0;
+if (@amf3_to_json($str, $pos, AMF3_UTF8_VALIDATE) !== false) die("UTF-8 test failed!\n");
+$pos = 0;
+if (amf3_to_json($str, $pos, AMF3_UTF8_REPLACE) !== json_encode(array("A\u{FFFD}B", "\u{FFFD}", "\u{FFFD}\u{FFFD}\u{FFFD}", "A\u{FFFD}B"), JSON_UNESCAPED_UNICODE)) die("UTF-8 test failed!\n");
+$str = "\x0c\x07\x41\xff\x42"; // ByteArray (0x41 0xff 0x42)
+$pos = 0;
+if (@amf3_to_json($str) !== false || amf3_to_json($str, $pos, AMF3_UTF8_REPLACE) !== "\"A\u{FFFD}B\"" || amf3_to_json("\x0c\x07\x41\x42\x43") !== '"ABC"') die("UTF-8 test failed!\n");
+
+//---------------------//
+// Decoding limit test //
+//---------------------//
+
+function decodeLimit($val, $opts) {
+	$str = amf3_encode($val);
+	$pos = 0;
+	$res = @amf3_decode($str, $pos, $opts);
+	return $pos == strlen($str) && $res === $val;
+}
+
+$val = 1;
+for ($i = 0; $i < 10; ++$i) $val = array($val);
+if (!decodeLimit($val, array('max_depth' => 11)) || decodeLimit($val, array('max_depth' => 10))) die("Decoding limit test failed!\n");
+$val = array_fill(0, 100, 1);
+if (!decodeLimit($val, array('max_elements' => 101)) || decodeLimit($val, array('max_elements' => 100))) die("Decoding limit test failed!\n");
+$val = array('ABC', 'ABC');
+if (!decodeLimit($val, array('max_bytes' => 6)) || decodeLimit($val, array('max_bytes' => 5))) die("Decoding limit test failed!\n");
+if (decodeLimit($val, array('max_depth' => 2, 'foo' => 1))) die("Decoding limit test failed!\n");
+$val = array('A', 'B', 'C');
+if (!decodeLimit($val, array('max_refs' => 3)) || decodeLimit($val, array('max_refs' => 2))) die("Decoding limit test failed!\n");
+$str = "\x0a\x33\x07\x41\x42\x43\x03\x41\x03\x42\x03\x43" // Sealed class ABC with members A, B, C
+	.	"\x04\x01\x04\x02\x04\x03"; // Member values: A:1, B:2, C:3
+$pos = 0;
+if (amf3_decode($str, $pos, array('max_refs' => 4)) != array('A' => 1, 'B' => 2, 'C' => 3, '__class' => 'ABC')) die("Decoding limit test failed!\n");
+$pos = 0;
+if (@amf3_decode($str, $pos, array('max_refs' => 3)) !== null || strpos(error_get_last()['message'], 'at position 10') === false) die("Decoding limit test failed!\n"); // Member name 'C'
+ini_set('amf3.decode_max_depth', -1); // Negative means no limit
+if (!decodeLimit($val, 0)) die("Decoding limit test failed!\n");
+ini_restore('amf3.decode_max_depth');
+
 //-----------------------//
 // AMF3Serializable test //
 //-----------------------//